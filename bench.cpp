@@ -0,0 +1,955 @@
+// micro-benchmarks for the spatial index. does not need SDL:
+//   g++ -std=c++11 -Wall -O2 -pthread bench.cpp -o bench
+
+// 64 bit file offsets on 32 bit systems too, for snapshots over 2 GB
+#define _FILE_OFFSET_BITS 64
+
+#include <cstdlib>
+#include <cstdio>
+#include <cassert>
+#include <cmath>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+
+using std::vector;
+using std::pair;
+using std::make_pair;
+using std::swap;
+
+typedef int8_t i8;
+typedef int16_t i16;
+typedef int32_t i32;
+typedef int64_t i64;
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef float f32;
+typedef double f64;
+
+#include "math.h"
+#include "bitvector.cpp"
+#include "workers.cpp"
+#include "mapped_file.cpp"
+#include "zorder.cpp"
+#include "zorder3.cpp"
+
+
+static f64 now_ms() {
+    using namespace std::chrono;
+    return duration<f64, std::milli>(high_resolution_clock::now().time_since_epoch()).count();
+}
+
+// keeps the optimizer from throwing away the measured work
+static volatile u32 sink;
+
+
+static void bench_codec(const char *name) {
+    const u32 count = 1 << 20;
+    const u32 reps = 50;
+    std::mt19937 rng(1);
+    vector<u32> xs(count), zs(count);
+    for (u32 i = 0; i < count; ++i)
+        xs[i] = rng() & 0xffff;
+
+    f64 t0 = now_ms();
+    for (u32 r = 0; r < reps; ++r)
+        for (u32 i = 0; i < count; ++i)
+            zs[i] = zorder::interleave(xs[i], xs[(i + r) & (count - 1)]);
+    f64 t1 = now_ms();
+    u32 acc = 0;
+    for (u32 r = 0; r < reps; ++r)
+        for (u32 i = 0; i < count; ++i)
+            acc += zorder::deinterleave_x(zs[i]) ^ zorder::deinterleave_y(zs[i]);
+    f64 t2 = now_ms();
+
+    vector<u64> wide(count);
+    for (u32 r = 0; r < reps; ++r)
+        for (u32 i = 0; i < count; ++i)
+            wide[i] = zorder::interleave64(xs[i] * 0x10001u, xs[(i + r) & (count - 1)]);
+    f64 t3 = now_ms();
+    for (u32 r = 0; r < reps; ++r)
+        for (u32 i = 0; i < count; ++i)
+            acc += zorder::deinterleave_x64(wide[i]) ^ zorder::deinterleave_y64(wide[i]);
+    f64 t4 = now_ms();
+    sink = acc;
+
+    f64 ops = (f64)count * reps;
+    printf("%-10s interleave: %6.2f ns/key   deinterleave x+y: %6.2f ns/key\n", name,
+           (t1 - t0) * 1e6 / ops, (t2 - t1) * 1e6 / ops);
+    printf("%-10s interleave64: %4.2f ns/key   deinterleave64 x+y: %4.2f ns/key\n", name,
+           (t3 - t2) * 1e6 / ops, (t4 - t3) * 1e6 / ops);
+}
+
+
+static vector<v2> random_points(u32 count, f32 extent, u32 seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<f32> coord(0, extent);
+    vector<v2> points(count);
+    for (v2 &p : points)
+        p = v2{coord(rng), coord(rng)};
+    return points;
+}
+
+
+static void bench_encode(const char *name) {
+    const u32 count = 200000;
+    const u32 reps = 100;
+    vector<v2> points = random_points(count, 10000, 2);
+    vector<u32> keys(count);
+
+    f64 t0 = now_ms();
+    for (u32 r = 0; r < reps; ++r) {
+        v2 min, max;
+        zorder::compute_bounds(points.data(), count, min, max);
+        zorder::encode_points(points.data(), count, min, zorder::discretize_scale(max - min), keys.data());
+    }
+    f64 t1 = now_ms();
+    sink = keys[count / 2];
+
+    printf("%-10s bounds+encode %u points: %6.3f ms\n", name, count, (t1 - t0) / reps);
+}
+
+
+// sorts (key, id) pairs like make_index does
+static void bench_sort(const char *name, const vector<v2> &points) {
+    const u32 reps = 20;
+    u32 count = (u32)points.size();
+    v2 min, max;
+    zorder::compute_bounds(points.data(), count, min, max);
+    vector<u32> keys(count);
+    zorder::encode_points(points.data(), count, min, zorder::discretize_scale(max - min), keys.data());
+    vector<u32> ids(count);
+    vector<pair<u32,u32>> pairs(count);
+    for (u32 i = 0; i < count; ++i) {
+        ids[i] = i;
+        pairs[i] = make_pair(keys[i], i);
+    }
+
+    vector<u32> work_keys, work_ids, key_scratch, id_scratch;
+    vector<pair<u32,u32>> work_pairs;
+    f64 t_std = 0, t_radix = 0;
+    for (u32 r = 0; r < reps; ++r) {
+        work_pairs = pairs;
+        f64 t0 = now_ms();
+        std::sort(work_pairs.begin(), work_pairs.end());
+        t_std += now_ms() - t0;
+
+        work_keys = keys;
+        work_ids = ids;
+        t0 = now_ms();
+        zorder::radix_sort(work_keys, work_ids, key_scratch, id_scratch);
+        t_radix += now_ms() - t0;
+    }
+    sink = work_keys[count / 2] + work_pairs[count / 2].second;
+
+    printf("sort %-9s %u keys+ids: std::sort %6.3f ms   radix %6.3f ms\n", name, count,
+           t_std / reps, t_radix / reps);
+}
+
+
+// area lookups on index after commit() against a fresh build of positions
+// under the same bounds, which must find the same points
+static void check_commit(const zorder::ZOrderIndex &index, const vector<v2> &positions) {
+    zorder::ZOrderIndex fresh;
+    fresh.set_fixed_bounds(index.minpos, index.maxpos);
+    fresh.make_index(positions);
+    assert(index.zvalues == fresh.zvalues);
+
+    std::mt19937 rng(10);
+    std::uniform_real_distribution<f32> coord(-1000, 11000);
+    vector<u32> expected, result;
+    zorder::QueryScratch<u32> scratch;
+    for (u32 q = 0; q < 500; ++q) {
+        v2 c = v2{coord(rng), coord(rng)};
+        index.area_lookup(c - v2{300, 300}, c + v2{300, 300}, result, scratch);
+        fresh.area_lookup(c - v2{300, 300}, c + v2{300, 300}, expected);
+        std::sort(result.begin(), result.end());
+        std::sort(expected.begin(), expected.end());
+        assert(result == expected);
+    }
+}
+
+// commit() of a few moved points against building the index again: moves
+// within the slack, which are merged in, moves outside it, which rebuild, and
+// moves out of fixed bounds, which clamp
+static void bench_commit(const vector<v2> &points) {
+    const u32 moved_count = (u32)points.size() / 100;
+    std::mt19937 rng(9);
+    std::uniform_real_distribution<f32> step(-20, 20);
+    vector<v2> positions = points;
+    zorder::ZOrderIndex index;
+    index.bounds_slack = 0.05f;
+    index.make_index(positions);
+
+    f64 t0 = now_ms();
+    zorder::ZOrderIndex rebuilt;
+    rebuilt.bounds_slack = 0.05f;
+    rebuilt.make_index(positions);
+    f64 build_ms = now_ms() - t0;
+
+    for (u32 i = 0; i < moved_count; ++i) {
+        u32 id = rng() % (u32)positions.size();
+        v2 &p = positions[id];
+        p = v2{std::min(std::max(p.x + step(rng), 0.0f), 10000.0f), std::min(std::max(p.y + step(rng), 0.0f), 10000.0f)};
+        index.update(id, p);
+    }
+    v2 old_min = index.minpos;
+    t0 = now_ms();
+    index.commit();
+    f64 commit_ms = now_ms() - t0;
+    assert(index.minpos.x == old_min.x && index.minpos.y == old_min.y);
+    check_commit(index, positions);
+
+    for (u32 i = 0; i < 10; ++i) {
+        u32 id = rng() % (u32)positions.size();
+        positions[id] = v2{12000, 500.0f * i};
+        index.update(id, positions[id]);
+    }
+    index.commit();
+    assert(index.maxpos.x > 12000);
+    check_commit(index, positions);
+
+    index.set_fixed_bounds(v2{0, 0}, v2{10000, 10000});
+    index.make_index(positions);
+    for (u32 i = 0; i < 10; ++i) {
+        u32 id = rng() % (u32)positions.size();
+        positions[id] = i & 1 ? v2{-500, 500.0f * i} : v2{10500, 20000};
+        index.update(id, positions[id]);
+    }
+    index.commit();
+    check_commit(index, positions);
+
+    printf("commit %u of %u points moved: %6.3f ms   make_index %6.3f ms\n", moved_count,
+           (u32)points.size(), commit_ms, build_ms);
+}
+
+
+// the same points and rectangles through the 2d index and, with heights added,
+// through both 3d variants. the 3d boxes span the full height, so all three
+// return the same points up to the quantization of each grid
+static void bench_3d() {
+    const u32 count = 200000;
+    const u32 query_count = 2000;
+    const f32 extent = 10000;
+    const f32 height = 500;
+    std::mt19937 rng(5);
+    std::uniform_real_distribution<f32> coord(0, extent);
+    std::uniform_real_distribution<f32> elevation(0, height);
+    vector<v2> points2(count);
+    vector<v3> points3(count);
+    for (u32 i = 0; i < count; ++i) {
+        points2[i] = v2{coord(rng), coord(rng)};
+        points3[i] = v3{points2[i].x, points2[i].y, elevation(rng)};
+    }
+    vector<v2> corners(query_count);
+    for (v2 &c : corners)
+        c = v2{coord(rng), coord(rng)};
+    const f32 query_size = 20;
+
+    zorder::ZOrderIndex index2;
+    zorder3::ZOrderIndex3 index3;
+    zorder3::ZOrderIndex3_64 index3_64;
+    vector<u32> result;
+    u64 found;
+
+    f64 t0 = now_ms();
+    index2.make_index(points2);
+    f64 t1 = now_ms();
+    found = 0;
+    for (v2 c : corners) {
+        index2.area_lookup(c, c + v2{query_size, query_size}, result);
+        found += result.size();
+    }
+    f64 t2 = now_ms();
+    printf("2d  (16 bits/axis) build %6.2f ms   %6.2f us/query   %llu found\n",
+           t1 - t0, (t2 - t1) * 1000 / query_count, (unsigned long long)found);
+
+    t0 = now_ms();
+    index3.make_index(points3);
+    t1 = now_ms();
+    found = 0;
+    for (v2 c : corners) {
+        index3.area_lookup(v3{c.x, c.y, 0}, v3{c.x + query_size, c.y + query_size, height}, result);
+        found += result.size();
+    }
+    t2 = now_ms();
+    printf("3d  (10 bits/axis) build %6.2f ms   %6.2f us/query   %llu found\n",
+           t1 - t0, (t2 - t1) * 1000 / query_count, (unsigned long long)found);
+
+    t0 = now_ms();
+    index3_64.make_index(points3);
+    t1 = now_ms();
+    found = 0;
+    for (v2 c : corners) {
+        index3_64.area_lookup(v3{c.x, c.y, 0}, v3{c.x + query_size, c.y + query_size, height}, result);
+        found += result.size();
+    }
+    t2 = now_ms();
+    printf("3d  (21 bits/axis) build %6.2f ms   %6.2f us/query   %llu found\n",
+           t1 - t0, (t2 - t1) * 1000 / query_count, (unsigned long long)found);
+}
+
+
+// clusters of normally distributed points in an otherwise empty world
+static vector<v2> clustered_points(u32 count, u32 cluster_count, f32 extent, f32 spread, u32 seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<f32> coord(0, extent);
+    std::normal_distribution<f32> offset(0, spread);
+    vector<v2> centres(cluster_count);
+    for (v2 &c : centres)
+        c = v2{coord(rng), coord(rng)};
+    vector<v2> points(count);
+    for (u32 i = 0; i < count; ++i) {
+        v2 c = centres[i % cluster_count];
+        points[i] = v2{c.x + offset(rng), c.y + offset(rng)};
+    }
+    return points;
+}
+
+
+// counts the candidate keys in the ranges, starting each range with a fresh
+// std::lower_bound like area_lookup used to
+static u64 scan_binary(const vector<u32> &keys, const pair<u32,u32> *ranges, u32 range_count) {
+    u64 candidates = 0;
+    auto search_start = keys.begin();
+    auto search_end = std::upper_bound(keys.begin(), keys.end(), ranges[range_count - 1].second);
+    for (u32 i = 0; i < range_count; ++i) {
+        auto it = std::lower_bound(search_start, search_end, ranges[i].first);
+        for (; it != search_end && *it <= ranges[i].second; ++it)
+            ++candidates;
+        search_start = it;
+    }
+    return candidates;
+}
+
+// the same, galloping from the cursor like area_lookup does now
+static u64 scan_gallop(const vector<u32> &keys, const pair<u32,u32> *ranges, u32 range_count) {
+    u64 candidates = 0;
+    const u32 *end = keys.data() + keys.size();
+    const u32 *it = keys.data();
+    for (u32 i = 0; i < range_count; ++i) {
+        if (it == end)
+            break;
+        if (*it > ranges[i].second)
+            continue;
+        it = zorder::gallop_lower_bound(it, end, ranges[i].first);
+        for (; it != end && *it <= ranges[i].second; ++it)
+            ++candidates;
+    }
+    return candidates;
+}
+
+static void bench_range_search(const char *name, const vector<v2> &points) {
+    const u32 query_count = 5000;
+    const f32 query_size = 150;
+    zorder::BasicZOrderIndex<u32, true> index;
+    index.range_budget = index.max_range_budget;
+    index.make_index(points);
+
+    // centre the queries on random points so they hit the data in both sets
+    std::mt19937 rng(6);
+    vector<pair<u32,u32>> all_ranges;
+    vector<u32> range_counts;
+    vector<u32> result;
+    for (u32 q = 0; q < query_count; ++q) {
+        v2 c = points[rng() % points.size()];
+        index.area_lookup(c - v2{query_size, query_size}, c + v2{query_size, query_size}, result);
+        all_ranges.insert(all_ranges.end(), index.default_scratch.ranges, index.default_scratch.ranges + index.default_scratch.range_count);
+        range_counts.push_back(index.default_scratch.range_count);
+    }
+
+    u64 binary_candidates = 0, gallop_candidates = 0;
+    f64 t0 = now_ms();
+    for (u32 q = 0, first = 0; q < query_count; first += range_counts[q++])
+        binary_candidates += scan_binary(index.zvalues, &all_ranges[first], range_counts[q]);
+    f64 t1 = now_ms();
+    for (u32 q = 0, first = 0; q < query_count; first += range_counts[q++])
+        gallop_candidates += scan_gallop(index.zvalues, &all_ranges[first], range_counts[q]);
+    f64 t2 = now_ms();
+    assert(binary_candidates == gallop_candidates);
+    sink = (u32)gallop_candidates;
+
+    const zorder::QueryStats &stats = index.default_scratch.stats;
+    printf("range search %-9s %.1f ranges/query: lower_bound %6.2f us/query   gallop %6.2f us/query\n",
+           name, (f64)stats.ranges / stats.queries,
+           (t1 - t0) * 1000 / query_count, (t2 - t1) * 1000 / query_count);
+    printf("             %-9s %.1f keys scanned/query, %.1f%% false positives\n", name,
+           (f64)stats.keys_scanned / stats.queries, 100.0 * stats.false_positives / stats.keys_scanned);
+}
+
+
+// knn against the old way of finding neighbours: area lookups on a square
+// that doubles until it holds k points, followed by a sort on distance
+static void bench_knn(const char *name, const vector<v2> &points) {
+    const u32 query_count = 5000;
+    const u32 k = 16;
+    zorder::ZOrderIndex index;
+    index.make_index(points);
+
+    vector<v2> centres = random_points(query_count, 10000, 9);
+
+    vector<u32> result;
+    vector<pair<f32,u32>> candidates;
+    // the k nearest of each query, closest first, by both ways
+    vector<pair<f32,u32>> grow_answers;
+    vector<u32> knn_answers;
+    grow_answers.reserve(query_count * k);
+    knn_answers.reserve(query_count * k);
+    f64 t0 = now_ms();
+    for (v2 c : centres) {
+        f32 half = 10;
+        for (;;) {
+            index.area_lookup(c - v2{half, half}, c + v2{half, half}, result);
+            if (result.size() >= k)
+                break;
+            half *= 2;
+        }
+        // a point in the corner of the square may be further away than one just
+        // outside it, so the square has to cover the circle of the k-th distance
+        candidates.clear();
+        for (u32 id : result)
+            candidates.push_back(make_pair(sqrlen(points[id] - c), id));
+        std::nth_element(candidates.begin(), candidates.begin() + (k - 1), candidates.end());
+        f32 reach = sqrtf(candidates[k - 1].first);
+        index.area_lookup(c - v2{reach, reach}, c + v2{reach, reach}, result);
+        candidates.clear();
+        for (u32 id : result)
+            candidates.push_back(make_pair(sqrlen(points[id] - c), id));
+        std::partial_sort(candidates.begin(), candidates.begin() + k, candidates.end());
+        grow_answers.insert(grow_answers.end(), candidates.begin(), candidates.begin() + k);
+    }
+    f64 t1 = now_ms();
+    for (v2 c : centres) {
+        index.knn(c, k, result);
+        knn_answers.insert(knn_answers.end(), result.begin(), result.end());
+    }
+    f64 t2 = now_ms();
+
+    // the same distances in the same order. the ids may only differ among
+    // points tied with the k-th distance, where either is a right answer
+    assert(knn_answers.size() == grow_answers.size());
+    for (u32 q = 0; q < query_count; ++q) {
+        f32 kth = grow_answers[q * k + k - 1].first;
+        for (u32 i = q * k; i < q * k + k; ++i) {
+            assert(sqrlen(points[knn_answers[i]] - centres[q]) == grow_answers[i].first);
+            assert(grow_answers[i].first == kth || knn_answers[i] == grow_answers[i].second);
+        }
+    }
+    sink = knn_answers[0] + grow_answers[0].second;
+
+    printf("knn k=%u %-9s growing area_lookup %6.2f us/query   knn %6.2f us/query\n", k, name,
+           (t1 - t0) * 1000 / query_count, (t2 - t1) * 1000 / query_count);
+}
+
+
+// radius_lookup against an area_lookup of the bounding square followed by a
+// distance test on every result
+static void bench_radius(const char *name, const vector<v2> &points) {
+    const u32 query_count = 5000;
+    const f32 radius = 150;
+    zorder::ZOrderIndex index;
+    index.make_index(points);
+
+    vector<v2> centres;
+    std::mt19937 rng(10);
+    for (u32 q = 0; q < query_count; ++q)
+        centres.push_back(points[rng() % points.size()]);
+
+    vector<u32> result;
+    u64 square_total = 0, radius_total = 0;
+    f64 t0 = now_ms();
+    for (v2 c : centres) {
+        index.area_lookup(c - v2{radius, radius}, c + v2{radius, radius}, result);
+        for (u32 id : result)
+            square_total += sqrlen(points[id] - c) <= radius * radius;
+    }
+    f64 t1 = now_ms();
+    for (v2 c : centres) {
+        index.radius_lookup(c, radius, result);
+        radius_total += result.size();
+    }
+    f64 t2 = now_ms();
+    assert(square_total == radius_total);
+    sink = (u32)radius_total;
+
+    printf("radius %-9s square + filter %6.2f us/query   radius_lookup %6.2f us/query\n", name,
+           (t1 - t0) * 1000 / query_count, (t2 - t1) * 1000 / query_count);
+}
+
+
+// one frame of sensor queries, answered one by one and as a batch
+static void bench_batch(const char *name, const vector<v2> &points, u32 query_count, f32 query_size) {
+    zorder::ZOrderIndex index;
+    index.make_index(points);
+
+    vector<zorder::AreaQuery> queries;
+    std::mt19937 rng(11);
+    for (u32 q = 0; q < query_count; ++q) {
+        v2 c = points[rng() % points.size()];
+        queries.push_back(zorder::AreaQuery{c - v2{query_size, query_size}, c + v2{query_size, query_size}});
+    }
+
+    // both ways end up with the results of all queries in one buffer, and both
+    // run once up front so that the timing doesn't include growing the buffers
+    vector<u32> result, offsets, flat_result, batch_result;
+    f64 t_single = 0;
+    for (u32 run = 0; run < 2; ++run) {
+        flat_result.clear();
+        offsets.clear();
+        f64 t0 = now_ms();
+        offsets.push_back(0);
+        for (const zorder::AreaQuery &q : queries) {
+            index.area_lookup(q.p0, q.p1, result);
+            flat_result.insert(flat_result.end(), result.begin(), result.end());
+            offsets.push_back((u32)flat_result.size());
+        }
+        t_single = now_ms() - t0;
+    }
+    u64 single_total = flat_result.size();
+
+    vector<u32> batch_offsets;
+    index.area_lookup_batch(queries, batch_offsets, batch_result);
+    f64 t1 = now_ms();
+    index.area_lookup_batch(queries, batch_offsets, batch_result);
+    f64 t2 = now_ms();
+    assert(batch_offsets == offsets && batch_result == flat_result);
+    sink = (u32)single_total;
+
+    printf("batch %-9s %8u keys, %5u queries of %3.0f: one by one %7.2f ms   area_lookup_batch %7.2f ms\n", name,
+           (u32)points.size(), query_count, query_size, t_single, t2 - t1);
+}
+
+
+// sensor queries for 20k units spread over pools of more and more threads
+static void bench_parallel(const char *name, const vector<v2> &points) {
+    const u32 query_count = 20000;
+    const f32 query_size = 50;
+    zorder::ZOrderIndex index;
+    index.make_index(points);
+
+    vector<zorder::AreaQuery> queries;
+    std::mt19937 rng(12);
+    for (u32 q = 0; q < query_count; ++q) {
+        v2 c = points[rng() % points.size()];
+        queries.push_back(zorder::AreaQuery{c - v2{query_size, query_size}, c + v2{query_size, query_size}});
+    }
+
+    u32 hardware_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    vector<u32> offsets, result;
+    f64 single_ms = 0;
+    for (u32 threads = 1; threads <= hardware_threads; threads *= 2) {
+        WorkerPool pool(threads);
+        // the first run grows the buffers
+        index.parallel_area_lookup(pool, queries, offsets, result);
+        f64 t0 = now_ms();
+        index.parallel_area_lookup(pool, queries, offsets, result);
+        f64 t1 = now_ms();
+        sink = (u32)result.size();
+        if (threads == 1)
+            single_ms = t1 - t0;
+        printf("parallel %-9s %2u threads: %6.2f ms for %u queries (%.2fx)\n", name, threads,
+               t1 - t0, query_count, single_ms / (t1 - t0));
+    }
+}
+
+
+// rebuilding the index for 1M moving particles, on more and more threads
+static void bench_parallel_build(const char *name, const vector<v2> &points) {
+    const u32 runs = 5;
+    zorder::ZOrderIndex index;
+    index.make_index(points);
+    f64 t0 = now_ms();
+    for (u32 i = 0; i < runs; ++i)
+        index.make_index(points);
+    f64 serial_ms = (now_ms() - t0) / runs;
+    printf("build %-9s serial:     %6.2f ms\n", name, serial_ms);
+
+    // at least one parallel build, so the comparison with the serial one
+    // runs even on a single core
+    u32 hardware_threads = std::max(std::thread::hardware_concurrency(), 2u);
+    for (u32 threads = 2; threads <= hardware_threads; threads *= 2) {
+        WorkerPool pool(threads);
+        zorder::ZOrderIndex parallel;
+        parallel.make_index(pool, points);
+        assert(parallel.zvalues == index.zvalues);
+        assert(parallel.ids == index.ids);
+        f64 t1 = now_ms();
+        for (u32 i = 0; i < runs; ++i)
+            parallel.make_index(pool, points);
+        f64 parallel_ms = (now_ms() - t1) / runs;
+        printf("build %-9s %2u threads: %6.2f ms (%.2fx)\n", name, threads, parallel_ms, serial_ms / parallel_ms);
+    }
+}
+
+
+// small lookups, where finding the start of each range is most of the work,
+// with and without the summary of every 64th key
+static void bench_summary(u32 point_count) {
+    const u32 query_count = 20000;
+    const f32 query_size = 5;
+    vector<v2> points = random_points(point_count, 10000, 13);
+    zorder::ZOrderIndex index;
+    index.use_prefix_table = false;
+
+    vector<v2> centres = random_points(query_count, 10000, 14);
+
+    vector<u32> result;
+    f64 ms[2];
+    for (u32 with_summary = 0; with_summary < 2; ++with_summary) {
+        index.use_summary = with_summary != 0;
+        index.make_index(points);
+        u64 total = 0;
+        f64 t0 = now_ms();
+        for (v2 c : centres) {
+            index.area_lookup(c - v2{query_size, query_size}, c + v2{query_size, query_size}, result);
+            total += result.size();
+        }
+        ms[with_summary] = now_ms() - t0;
+        sink = (u32)total;
+    }
+    printf("summary %8u keys: without %6.3f us/query   with %6.3f us/query\n", point_count,
+           ms[0] * 1000 / query_count, ms[1] * 1000 / query_count);
+}
+
+// random range-start searches over all keys, with std::lower_bound on the
+// sorted keys, and through the summary, the eytzinger layout and the prefix
+// table
+static void bench_search_layout(u32 point_count) {
+    const u32 search_count = 1000000;
+    vector<v2> points = random_points(point_count, 10000, 15);
+    zorder::ZOrderIndex index;
+    index.make_index(points);
+
+    vector<u32> values;
+    std::mt19937 rng(16);
+    std::uniform_int_distribution<u32> key(0, index.zvalues.back());
+    for (u32 i = 0; i < search_count; ++i)
+        values.push_back(key(rng));
+
+    const u32 *zbegin = index.zvalues.data();
+    const u32 *zend = zbegin + index.zvalues.size();
+    u64 total = 0;
+    f64 t0 = now_ms();
+    for (u32 v : values)
+        total += std::lower_bound(zbegin, zend, v) - zbegin;
+    f64 std_ms = now_ms() - t0;
+    u64 check = total;
+
+    // 0: summary, 1: eytzinger, 2: prefix table
+    f64 ms[3];
+    for (u32 layout = 0; layout < 3; ++layout) {
+        index.use_eytzinger = layout == 1;
+        index.use_prefix_table = layout == 2;
+        index.make_index(points);
+        // the rebuild may move the keys. seek() leaves keys close to the start
+        // to a gallop, so start far away
+        zbegin = index.zvalues.data();
+        total = 0;
+        t0 = now_ms();
+        for (u32 v : values)
+            total += index.seek(zbegin, v) - zbegin;
+        ms[layout] = now_ms() - t0;
+        assert(total == check);
+    }
+    sink = (u32)total;
+
+    printf("search %8u keys: lower_bound %6.1f ns   summary %6.1f ns   eytzinger %6.1f ns   prefix %6.1f ns\n",
+           point_count, std_ms * 1e6 / search_count, ms[0] * 1e6 / search_count,
+           ms[1] * 1e6 / search_count, ms[2] * 1e6 / search_count);
+}
+
+// wide area lookups, where the scans of the ranges are most of the work
+static void bench_filter(const char *name, const vector<v2> &points) {
+    const u32 query_count = 2000;
+    const f32 query_size = 500;
+    zorder::BasicZOrderIndex<u32, true> index;
+    index.make_index(points);
+
+    vector<v2> centres = random_points(query_count, 10000, 19);
+
+    vector<u32> result;
+    u64 total = 0;
+    f64 t0 = now_ms();
+    for (v2 c : centres) {
+        index.area_lookup(c - v2{query_size, query_size}, c + v2{query_size, query_size}, result);
+        total += result.size();
+    }
+    f64 ms = now_ms() - t0;
+    sink = (u32)total;
+
+    const zorder::QueryStats &stats = index.default_scratch.stats;
+    printf("filter %-10s %6.0f keys/query (%2.0f%% outside): %7.2f us/query\n", name,
+           (f64)stats.keys_scanned / stats.queries, 100.0 * stats.false_positives / stats.keys_scanned,
+           ms * 1000 / query_count);
+}
+
+// a large static layer, with plain and compressed keys
+static void bench_frozen(u32 point_count) {
+    const u32 query_count = 20000;
+    const f32 query_size = 20;
+    vector<v2> points = random_points(point_count, 10000, 20);
+    zorder::ZOrderIndex index;
+    index.make_index(points);
+    zorder::FrozenZOrderIndex frozen;
+    frozen.freeze(index);
+
+    vector<v2> centres = random_points(query_count, 10000, 21);
+
+    vector<u32> result;
+    u64 total = 0;
+    f64 t0 = now_ms();
+    for (v2 c : centres) {
+        index.area_lookup(c - v2{query_size, query_size}, c + v2{query_size, query_size}, result);
+        total += result.size();
+    }
+    f64 t1 = now_ms();
+    for (v2 c : centres) {
+        frozen.area_lookup(c - v2{query_size, query_size}, c + v2{query_size, query_size}, result);
+        total -= result.size();
+    }
+    f64 t2 = now_ms();
+    assert(total == 0);
+    sink = (u32)total;
+
+    // the keys alone, against the keys and the block directory. the search
+    // structures of the plain index are left out
+    size_t plain_bytes = index.zvalues.size() * sizeof(u32);
+    printf("frozen %8u keys: %6.1f MB -> %5.1f MB (%.1fx)   lookups %6.3f -> %6.3f us/query\n",
+           point_count, plain_bytes / 1e6, frozen.key_bytes() / 1e6, (f64)plain_bytes / frozen.key_bytes(),
+           (t1 - t0) * 1000 / query_count, (t2 - t1) * 1000 / query_count);
+}
+
+// loading a static layer: building it from its points, against opening a
+// snapshot baked from it and answering the first lookup
+static void bench_snapshot(u32 point_count) {
+    const char *path = "bench_snapshot.bin";
+    vector<v2> points = random_points(point_count, 10000, 22);
+    zorder::ZOrderIndex index;
+    f64 t0 = now_ms();
+    index.make_index(points);
+    f64 build_ms = now_ms() - t0;
+
+    zorder::FrozenZOrderIndex frozen;
+    frozen.freeze(index);
+    t0 = now_ms();
+    bool baked = frozen.bake(path);
+    f64 bake_ms = now_ms() - t0;
+    if (!baked) {
+        printf("snapshot: could not write %s\n", path);
+        return;
+    }
+
+    zorder::FrozenZOrderIndex loaded;
+    vector<u32> result;
+    t0 = now_ms();
+    bool opened = loaded.open(path);
+    if (opened)
+        loaded.area_lookup(v2{4000, 4000}, v2{4100, 4100}, result);
+    f64 open_ms = now_ms() - t0;
+    sink = (u32)result.size();
+    loaded.clear();
+    remove(path);
+
+    printf("snapshot %8u keys: make_index %7.2f ms   bake %7.2f ms   open + lookup %6.3f ms%s\n", point_count,
+           build_ms, bake_ms, open_ms, opened ? "" : " (open failed)");
+}
+
+// writing a snapshot of more points than the memory budget holds, fed in
+// chunks, against building the whole index in memory and baking it
+static void bench_stream_build(u32 point_count, size_t budget) {
+    const char *path = "bench_stream.bin";
+    const u32 chunk = 65536;
+    vector<v2> points = random_points(point_count, 10000, 23);
+    v2 lo = v2{0, 0};
+    v2 hi = v2{10000, 10000};
+
+    f64 t0 = now_ms();
+    // a small query, and one over the whole snapshot, which gives all ids in
+    // key order
+    const v2 queries[2][2] = {{v2{4000, 4000}, v2{4100, 4100}}, {lo, hi}};
+    vector<u32> expected[2];
+    bool baked;
+    {
+        zorder::ZOrderIndex index;
+        index.set_fixed_bounds(lo, hi);
+        index.make_index(points);
+        zorder::FrozenZOrderIndex frozen;
+        frozen.freeze(index);
+        baked = frozen.bake(path);
+        for (u32 q = 0; q < 2; ++q)
+            frozen.area_lookup(queries[q][0], queries[q][1], expected[q]);
+    }
+    f64 memory_ms = now_ms() - t0;
+
+    t0 = now_ms();
+    zorder::ZOrderStreamBuilder builder;
+    builder.begin(lo, hi, budget, "bench_stream");
+    for (u32 i = 0; i < point_count; i += chunk)
+        builder.add(points.data() + i, min(chunk, point_count - i));
+    bool streamed = builder.finish(path);
+    f64 stream_ms = now_ms() - t0;
+
+    zorder::FrozenZOrderIndex loaded;
+    vector<u32> result;
+    bool opened = loaded.open(path);
+    assert(baked && streamed && opened);
+    for (u32 q = 0; q < 2; ++q) {
+        loaded.area_lookup(queries[q][0], queries[q][1], result);
+        assert(result == expected[q]);
+    }
+    assert(expected[1].size() == point_count);
+    loaded.clear();
+    remove(path);
+
+    printf("stream build %8u keys, %5.1f MB budget: in memory %7.2f ms   streamed %7.2f ms\n", point_count,
+           budget / 1e6, memory_ms, stream_ms);
+}
+
+// a sparse map, a few islands in an empty ocean, queried all over, without
+// the occupancy bitmap and with 2^12 and 2^16 blocks
+static void bench_occupancy() {
+    const u32 query_count = 20000;
+    const f32 query_size = 20;
+    vector<v2> points = clustered_points(1000000, 12, 10000, 60, 17);
+    points.push_back(v2{0, 0});
+    points.push_back(v2{10000, 10000});
+    zorder::ZOrderIndex index;
+
+    vector<v2> centres = random_points(query_count, 10000, 18);
+
+    const u32 settings[] = {0, 12, 16};
+    vector<u32> result;
+    f64 ms[3];
+    u64 check = 0;
+    for (u32 s = 0; s < 3; ++s) {
+        index.occupancy_bits = settings[s];
+        index.make_index(points);
+        u64 total = 0;
+        f64 t0 = now_ms();
+        for (v2 c : centres) {
+            index.area_lookup(c - v2{query_size, query_size}, c + v2{query_size, query_size}, result);
+            total += result.size();
+        }
+        ms[s] = now_ms() - t0;
+        assert(s == 0 || total == check);
+        check = total;
+        sink = (u32)total;
+    }
+    printf("occupancy sparse: off %6.3f us/query   2^12 %6.3f us/query   2^16 %6.3f us/query\n",
+           ms[0] * 1000 / query_count, ms[1] * 1000 / query_count, ms[2] * 1000 / query_count);
+}
+
+int main() {
+#ifdef ZORDER_X86
+    bool had_bmi2 = zorder::use_bmi2;
+    zorder::use_bmi2 = false;
+    bench_codec("portable");
+    if (had_bmi2) {
+        zorder::use_bmi2 = true;
+        bench_codec("bmi2");
+    } else {
+        puts("bmi2: not available (or slow) on this cpu");
+    }
+
+    bool had_avx2 = zorder::use_avx2;
+    bool had_sse2 = zorder::use_sse2;
+    zorder::use_avx2 = false;
+    zorder::use_sse2 = false;
+    bench_encode("portable");
+    if (had_sse2) {
+        zorder::use_sse2 = true;
+        bench_encode("sse2");
+    }
+    if (had_avx2) {
+        zorder::use_avx2 = true;
+        bench_encode("avx2");
+    }
+#else
+    bench_codec("portable");
+    bench_encode("portable");
+#endif
+
+    // the clustered set has all points in a small corner of a much larger
+    // world, so the top digits of the keys are constant
+    vector<v2> uniform = random_points(200000, 10000, 3);
+    vector<v2> clustered = random_points(200000, 100, 4);
+    clustered.push_back(v2{10000, 10000});
+    bench_sort("uniform", uniform);
+    bench_sort("clustered", clustered);
+
+    bench_3d();
+
+    bench_commit(random_points(1000000, 10000, 5));
+
+    vector<v2> lookup_uniform = random_points(1000000, 10000, 7);
+    vector<v2> lookup_clustered = clustered_points(1000000, 20, 10000, 300, 8);
+    bench_range_search("uniform", lookup_uniform);
+    bench_range_search("clustered", lookup_clustered);
+    bench_summary(100000);
+    bench_summary(1000000);
+    bench_summary(10000000);
+
+    bench_search_layout(10000);
+    bench_search_layout(100000);
+    bench_search_layout(1000000);
+    bench_search_layout(10000000);
+
+    bench_occupancy();
+
+    bench_frozen(1000000);
+    bench_frozen(5000000);
+
+    bench_snapshot(1000000);
+    bench_snapshot(5000000);
+
+    bench_stream_build(5000000, 8 << 20);
+    bench_stream_build(5000000, 64 << 20);
+
+#ifdef ZORDER_X86
+    zorder::use_avx2 = false;
+    zorder::use_sse2 = false;
+    bench_filter("portable", lookup_uniform);
+    if (had_sse2) {
+        zorder::use_sse2 = true;
+        bench_filter("sse2", lookup_uniform);
+    }
+    if (had_avx2) {
+        zorder::use_avx2 = true;
+        bench_filter("avx2", lookup_uniform);
+    }
+#else
+    bench_filter("portable", lookup_uniform);
+#endif
+
+    bench_knn("uniform", lookup_uniform);
+    bench_knn("clustered", lookup_clustered);
+
+    bench_radius("uniform", lookup_uniform);
+    bench_radius("clustered", lookup_clustered);
+
+    bench_batch("uniform", lookup_uniform, 5000, 150);
+    bench_batch("clustered", lookup_clustered, 5000, 150);
+    // large enough for area_lookup_batch to sweep
+    bench_batch("uniform", random_points(5000000, 10000, 24), 50000, 30);
+
+    bench_parallel("uniform", lookup_uniform);
+    bench_parallel("clustered", lookup_clustered);
+
+    bench_parallel_build("uniform", lookup_uniform);
+    bench_parallel_build("clustered", lookup_clustered);
+
+    return 0;
+}
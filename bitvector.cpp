@@ -0,0 +1,79 @@
+class BitVector {
+public:
+    bool is_set(u32 index) const {
+        u32 word_index = index >> 5;
+        if (word_index >= words.size())
+            return false;
+        return words[word_index] & (1 << (index & 31));
+    }
+
+    void set(u32 index, bool value) {
+        u32 word_index = index >> 5;
+        if (word_index >= words.size()) {
+            u32 new_size = words.size();
+            if (new_size < 8)
+                new_size = 8;
+            while (new_size <= word_index)
+                new_size += new_size >> 1;
+            words.resize(new_size);
+        }
+        if (value)
+            words[word_index] |= (1 << (index & 31));
+        else
+            words[word_index] &= ~(1 << (index & 31));
+    }
+
+    // whether any bit in first..last (inclusive) is set
+    bool any_set(u32 first, u32 last) const {
+        u32 first_word = first >> 5;
+        if (first_word >= words.size() || first > last)
+            return false;
+        u32 last_word = last >> 5;
+        u32 first_mask = ~0u << (first & 31);
+        u32 last_mask = ~0u >> (31 - (last & 31));
+        if (last_word >= words.size()) {
+            last_word = words.size() - 1;
+            last_mask = ~0u;
+        }
+        if (first_word == last_word)
+            return (words[first_word] & first_mask & last_mask) != 0;
+        if (words[first_word] & first_mask)
+            return true;
+        for (u32 i = first_word + 1; i < last_word; ++i) {
+            if (words[i])
+                return true;
+        }
+        return (words[last_word] & last_mask) != 0;
+    }
+
+    // the number of bits set
+    u32 count_set() const {
+        u32 count = 0;
+        for (u32 w : words) {
+            w = w - ((w >> 1) & 0x55555555);
+            w = (w & 0x33333333) + ((w >> 2) & 0x33333333);
+            count += (((w + (w >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+        }
+        return count;
+    }
+
+    void clear() {
+        words.clear();
+    }
+
+    // the raw words, for saving the bits and loading them back
+    const u32 *data() const {
+        return words.data();
+    }
+
+    u32 word_count() const {
+        return (u32)words.size();
+    }
+
+    void assign(const u32 *source, u32 count) {
+        words.assign(source, source + count);
+    }
+
+private:
+    vector<u32> words;
+};
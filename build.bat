@@ -5,4 +5,5 @@ set CFLAGS=/EHsc /MD /Iwin32_deps\include
 set LFLAGS=/SUBSYSTEM:CONSOLE /LIBPATH:win32_deps\lib SDL2main.lib SDL2.lib
 
 cl %CFLAGS% main.cpp /link %LFLAGS% || exit /b 1
+cl %CFLAGS% /O2 bench.cpp || exit /b 1
 
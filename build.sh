@@ -1,6 +1,6 @@
 #!/bin/sh
 
-CFLAGS="-std=c++11 -Wall"
+CFLAGS="-std=c++11 -Wall -pthread"
 
 if [ "$(uname)" == "Darwin" ];
 then # OSX
@@ -19,4 +19,5 @@ else
 fi
 
 g++ $CFLAGS main.cpp -o game
+g++ $CFLAGS -O2 bench.cpp -o bench
 
@@ -1,40 +1,6 @@
 
 
 
-class BitVector {
-public:
-    bool is_set(u32 index) const {
-        u32 word_index = index >> 5;
-        if (word_index >= words.size())
-            return false;
-        return words[word_index] & (1 << (index & 31));
-    }
-
-    void set(u32 index, bool value) {
-        u32 word_index = index >> 5;
-        if (word_index >= words.size()) {
-            u32 new_size = words.size();
-            if (new_size < 8)
-                new_size = 8;
-            while (new_size <= word_index)
-                new_size += new_size >> 1;
-            words.resize(new_size);
-        }
-        if (value)
-            words[word_index] |= (1 << (index & 31));
-        else
-            words[word_index] &= ~(1 << (index & 31));
-    }
-
-    void clear() {
-        words.clear();
-    }
-
-private:
-    vector<u32> words;
-};
-
-
 struct EntityId {
     u32 index;
 
@@ -1,13 +1,23 @@
+// 64 bit file offsets on 32 bit systems too, for snapshots over 2 GB
+#define _FILE_OFFSET_BITS 64
+
 #include <cstdlib>
 #include <cstdio>
 #include <cassert>
 #include <cmath>
 #include <cfloat>
 #include <cstdint>
+#include <cstring>
+#include <limits>
 
 #include <vector>
 #include <bitset>
 #include <algorithm>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 #include <SDL2/SDL.h>
 
@@ -31,7 +41,11 @@ static SDL_Window *window;
 static SDL_Renderer *renderer;
 
 #include "math.h"
+#include "bitvector.cpp"
+#include "workers.cpp"
+#include "mapped_file.cpp"
 #include "zorder.cpp"
+#include "zorder3.cpp"
 #include "entity.cpp"
 
 
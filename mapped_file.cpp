@@ -0,0 +1,111 @@
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// a whole file mapped read-only into memory. the mapping starts on a page
+// boundary, so anything aligned within the file is aligned in memory too
+class MappedFile {
+public:
+    MappedFile() {
+        bytes = 0;
+        byte_count = 0;
+#ifdef _WIN32
+        file = INVALID_HANDLE_VALUE;
+        mapping = 0;
+#endif
+    }
+
+    ~MappedFile() {
+        close();
+    }
+
+    bool open(const char *path) {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+            close();
+            return false;
+        }
+        mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+        if (!mapping) {
+            close();
+            return false;
+        }
+        bytes = (const u8 *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!bytes) {
+            close();
+            return false;
+        }
+        byte_count = (size_t)file_size.QuadPart;
+#else
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void *view = mmap(0, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        // the mapping stays valid after the descriptor is closed
+        ::close(fd);
+        if (view == MAP_FAILED)
+            return false;
+        bytes = (const u8 *)view;
+        byte_count = (size_t)info.st_size;
+#endif
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (bytes)
+            UnmapViewOfFile(bytes);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = 0;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (bytes)
+            munmap((void *)bytes, byte_count);
+#endif
+        bytes = 0;
+        byte_count = 0;
+    }
+
+    const u8 *data() const {
+        return bytes;
+    }
+
+    size_t size() const {
+        return byte_count;
+    }
+
+private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+
+    const u8 *bytes;
+    size_t byte_count;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+};
@@ -27,4 +27,26 @@ inline f32 dot(v2 a, v2 b) { return a.x * b.x + a.y * b.y; }
 inline f32 sqrlen(v2 a) { return dot(a, a); }
 inline f32 len(v2 a) { return sqrtf(sqrlen(a)); }
 
+struct v3 {
+    f32 x, y, z;
+
+    f32 &operator[](u32 i) { return (&x)[i]; }
+    f32 operator[](u32 i) const { return (&x)[i]; }
+};
+
+inline v3 operator-(v3 a) { return v3 { -a.x, -a.y, -a.z }; }
+
+inline v3 operator+(v3 a, v3 b) { return v3 { a.x + b.x, a.y + b.y, a.z + b.z }; }
+inline v3 operator-(v3 a, v3 b) { return v3 { a.x - b.x, a.y - b.y, a.z - b.z }; }
+
+inline v3 &operator+=(v3 &a, v3 b) { a.x += b.x; a.y += b.y; a.z += b.z; return a; }
+inline v3 &operator-=(v3 &a, v3 b) { a.x -= b.x; a.y -= b.y; a.z -= b.z; return a; }
+
+inline v3 operator*(v3 a, f32 s) { return v3 { a.x * s, a.y * s, a.z * s }; }
+inline v3 operator*(f32 s, v3 a) { return v3 { a.x * s, a.y * s, a.z * s }; }
+
+inline f32 dot(v3 a, v3 b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+inline f32 sqrlen(v3 a) { return dot(a, a); }
+inline f32 len(v3 a) { return sqrtf(sqrlen(a)); }
+
 #endif
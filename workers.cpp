@@ -0,0 +1,137 @@
+// a fixed set of threads that work through parallel_for jobs together with the
+// calling thread. the items of a job are cut into chunks, and each worker starts
+// on its own share of them. a worker that runs out of chunks steals from the
+// shares of the others, so items of uneven cost don't leave threads idle
+class WorkerPool {
+public:
+    // thread_count includes the calling thread. 0 means one per hardware thread
+    explicit WorkerPool(u32 thread_count = 0) {
+        if (thread_count == 0)
+            thread_count = std::thread::hardware_concurrency();
+        if (thread_count == 0)
+            thread_count = 1;
+        worker_count = thread_count;
+        shares = new Share[worker_count];
+        generation = 0;
+        busy = 0;
+        quit = false;
+        job = 0;
+        item_count = 0;
+        chunk_size = 1;
+        for (u32 i = 1; i < worker_count; ++i)
+            threads.push_back(std::thread(&WorkerPool::worker_main, this, i));
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+        for (u32 i = 0; i < threads.size(); ++i)
+            threads[i].join();
+        delete[] shares;
+    }
+
+    u32 size() const {
+        return worker_count;
+    }
+
+    // calls f(worker, begin, end) for consecutive ranges of at most chunk_size
+    // items that together cover 0..count, and returns once all are done. worker
+    // is below size(), and calls with the same worker never run at the same
+    // time, so it can be used to pick per-thread state
+    void parallel_for(u32 count, u32 chunk, const std::function<void(u32, u32, u32)> &f) {
+        if (count == 0)
+            return;
+        assert(chunk > 0);
+        u32 chunk_count = (count + chunk - 1) / chunk;
+        if (worker_count == 1 || chunk_count == 1) {
+            for (u32 begin = 0; begin < count; begin += chunk)
+                f(0, begin, std::min(begin + chunk, count));
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (u32 i = 0; i < worker_count; ++i) {
+                shares[i].next = (u32)((u64)chunk_count * i / worker_count);
+                shares[i].end = (u32)((u64)chunk_count * (i + 1) / worker_count);
+            }
+            job = &f;
+            item_count = count;
+            chunk_size = chunk;
+            busy = worker_count - 1;
+            ++generation;
+        }
+        wake.notify_all();
+
+        run(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (busy > 0)
+            done.wait(lock);
+        job = 0;
+    }
+
+private:
+    // the chunks a worker starts with. next is taken from by the owner and by
+    // thieves alike, and may be pushed past end. padded to a cache line so
+    // that workers don't contend on each other's counters
+    struct Share {
+        std::atomic<u32> next;
+        u32 end;
+        char pad[64 - sizeof(std::atomic<u32>) - sizeof(u32)];
+    };
+
+    void run(u32 worker) {
+        for (u32 i = 0; i < worker_count; ++i) {
+            Share &share = shares[(worker + i) % worker_count];
+            for (;;) {
+                u32 chunk = share.next.fetch_add(1);
+                if (chunk >= share.end)
+                    break;
+                u32 begin = chunk * chunk_size;
+                (*job)(worker, begin, std::min(begin + chunk_size, item_count));
+            }
+        }
+    }
+
+    void worker_main(u32 worker) {
+        u32 seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (!quit && generation == seen)
+                    wake.wait(lock);
+                if (quit)
+                    return;
+                seen = generation;
+            }
+
+            run(worker);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busy == 0)
+                done.notify_one();
+        }
+    }
+
+    WorkerPool(const WorkerPool &);
+    WorkerPool &operator=(const WorkerPool &);
+
+    u32 worker_count;
+    vector<std::thread> threads;
+    Share *shares;
+
+    // the current job, guarded by mutex when it changes
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    u32 generation;
+    u32 busy;
+    bool quit;
+    const std::function<void(u32, u32, u32)> *job;
+    u32 item_count;
+    u32 chunk_size;
+};
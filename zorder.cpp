@@ -1,9 +1,36 @@
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define ZORDER_X86 1
+#if defined(__x86_64__) || defined(_M_X64)
+#define ZORDER_X64 1
+#endif
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define ZORDER_TARGET_BMI2
+#define ZORDER_TARGET_SSE2
+#define ZORDER_TARGET_AVX2
+#else
+#include <cpuid.h>
+#define ZORDER_TARGET_BMI2 __attribute__((target("bmi2")))
+#define ZORDER_TARGET_SSE2 __attribute__((target("sse2")))
+#define ZORDER_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+#if defined(ZORDER_X86)
+#define ZORDER_PREFETCH(p) _mm_prefetch((const char *)(p), _MM_HINT_T0)
+#elif defined(__GNUC__)
+#define ZORDER_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define ZORDER_PREFETCH(p) ((void)0)
+#endif
+
 
 namespace zorder {
 
 
 // intersperses the lower 16 bits of x with zeroes
-inline u32 intersperse_zeroes(u32 x) {
+inline u32 intersperse_zeroes_portable(u32 x) {
     x = (x | (x << 8)) & 0x00ff00ff;
     x = (x | (x << 4)) & 0x0f0f0f0f;
     x = (x | (x << 2)) & 0x33333333;
@@ -12,6 +39,133 @@ inline u32 intersperse_zeroes(u32 x) {
 }
 
 
+// extract the x part of the interleaved numbers
+inline u32 deinterleave_x_portable(u32 z) {
+    z = z & 0x55555555;
+    z = (z | (z >> 1)) & 0x33333333;
+    z = (z | (z >> 2)) & 0x0f0f0f0f;
+    z = (z | (z >> 4)) & 0x00ff00ff;
+    z = (z | (z >> 8)) & 0x0000ffff;
+    return z;
+}
+
+
+// intersperses the 32 bits of x with zeroes
+inline u64 intersperse_zeroes64_portable(u32 x) {
+    u64 w = x;
+    w = (w | (w << 16)) & 0x0000ffff0000ffffull;
+    w = (w | (w << 8)) & 0x00ff00ff00ff00ffull;
+    w = (w | (w << 4)) & 0x0f0f0f0f0f0f0f0full;
+    w = (w | (w << 2)) & 0x3333333333333333ull;
+    w = (w | (w << 1)) & 0x5555555555555555ull;
+    return w;
+}
+
+
+// extract the x part of the 64 bit interleaved numbers
+inline u32 deinterleave_x64_portable(u64 z) {
+    z = z & 0x5555555555555555ull;
+    z = (z | (z >> 1)) & 0x3333333333333333ull;
+    z = (z | (z >> 2)) & 0x0f0f0f0f0f0f0f0full;
+    z = (z | (z >> 4)) & 0x00ff00ff00ff00ffull;
+    z = (z | (z >> 8)) & 0x0000ffff0000ffffull;
+    z = (z | (z >> 16)) & 0x00000000ffffffffull;
+    return (u32)z;
+}
+
+
+#ifdef ZORDER_X86
+
+// single instruction versions of the above. only call these when use_bmi2 is set
+ZORDER_TARGET_BMI2 inline u32 intersperse_zeroes_bmi2(u32 x) {
+    return _pdep_u32(x, 0x55555555);
+}
+
+ZORDER_TARGET_BMI2 inline u32 deinterleave_x_bmi2(u32 z) {
+    return _pext_u32(z, 0x55555555);
+}
+
+#ifdef ZORDER_X64
+ZORDER_TARGET_BMI2 inline u64 intersperse_zeroes64_bmi2(u32 x) {
+    return _pdep_u64(x, 0x5555555555555555ull);
+}
+
+ZORDER_TARGET_BMI2 inline u32 deinterleave_x64_bmi2(u64 z) {
+    return (u32)_pext_u64(z, 0x5555555555555555ull);
+}
+#endif
+
+
+static void cpuid(u32 regs[4], u32 leaf) {
+#ifdef _MSC_VER
+    __cpuidex((int *)regs, leaf, 0);
+#else
+    __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static u64 xgetbv0() {
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    u32 lo, hi;
+    __asm__ volatile ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((u64)hi << 32) | lo;
+#endif
+}
+
+struct CpuFeatures {
+    bool sse2;
+    bool avx2;
+    bool fast_bmi2;
+};
+
+static CpuFeatures detect_cpu_features() {
+    CpuFeatures features = {};
+    u32 regs[4];
+    cpuid(regs, 0);
+    u32 max_leaf = regs[0];
+    bool is_amd = regs[1] == 0x68747541; // "Auth"enticAMD
+    if (max_leaf < 1)
+        return features;
+
+    cpuid(regs, 1);
+    u32 family = (regs[0] >> 8) & 0xf;
+    if (family == 0xf)
+        family += (regs[0] >> 20) & 0xff;
+    features.sse2 = (regs[3] >> 26) & 1;
+    // the OS must also save the ymm registers on context switches
+    bool os_avx = ((regs[2] >> 27) & 1) && ((regs[2] >> 28) & 1) && (xgetbv0() & 6) == 6;
+    if (max_leaf < 7)
+        return features;
+
+    cpuid(regs, 7);
+    features.avx2 = os_avx && ((regs[1] >> 5) & 1);
+    // BMI2 is present from Haswell and Excavator on, but pdep/pext are microcoded
+    // on AMD before Zen 3 (family 19h) and much slower there than the shift cascade
+    features.fast_bmi2 = ((regs[1] >> 8) & 1) && !(is_amd && family < 0x19);
+    return features;
+}
+
+// chosen once at startup. may be cleared to force the portable paths
+static const CpuFeatures cpu_features = detect_cpu_features();
+static bool use_bmi2 = cpu_features.fast_bmi2;
+static bool use_avx2 = cpu_features.avx2;
+static bool use_sse2 = cpu_features.sse2;
+
+#endif
+
+
+// intersperses the lower 16 bits of x with zeroes
+inline u32 intersperse_zeroes(u32 x) {
+#ifdef ZORDER_X86
+    if (use_bmi2)
+        return intersperse_zeroes_bmi2(x);
+#endif
+    return intersperse_zeroes_portable(x);
+}
+
+
 // interleave the lower 16 bits of the two arguments
 inline u32 interleave(u32 x, u32 y) {
     return intersperse_zeroes(x) | (intersperse_zeroes(y) << 1);
@@ -20,12 +174,11 @@ inline u32 interleave(u32 x, u32 y) {
 
 // extract the x part of the interleaved numbers
 inline u32 deinterleave_x(u32 z) {
-    z = z & 0x55555555;
-    z = (z | (z >> 1)) & 0x33333333;
-    z = (z | (z >> 2)) & 0x0f0f0f0f;
-    z = (z | (z >> 4)) & 0x00ff00ff;
-    z = (z | (z >> 8)) & 0x0000ffff;
-    return z;
+#ifdef ZORDER_X86
+    if (use_bmi2)
+        return deinterleave_x_bmi2(z);
+#endif
+    return deinterleave_x_portable(z);
 }
 
 
@@ -35,6 +188,32 @@ inline u32 deinterleave_y(u32 z) {
 }
 
 
+// 64 bit versions of the above, with 32 bits per axis
+inline u64 intersperse_zeroes64(u32 x) {
+#ifdef ZORDER_X64
+    if (use_bmi2)
+        return intersperse_zeroes64_bmi2(x);
+#endif
+    return intersperse_zeroes64_portable(x);
+}
+
+inline u64 interleave64(u32 x, u32 y) {
+    return intersperse_zeroes64(x) | (intersperse_zeroes64(y) << 1);
+}
+
+inline u32 deinterleave_x64(u64 z) {
+#ifdef ZORDER_X64
+    if (use_bmi2)
+        return deinterleave_x64_bmi2(z);
+#endif
+    return deinterleave_x64_portable(z);
+}
+
+inline u32 deinterleave_y64(u64 z) {
+    return deinterleave_x64(z >> 1);
+}
+
+
 // https://graphics.stanford.edu/~seander/bithacks.html#IntegerLogDeBruijn
 inline u32 highest_bit_position(u32 v) {
     static const u8 debruijn32[32] = {
@@ -49,63 +228,55 @@ inline u32 highest_bit_position(u32 v) {
     return debruijn32[(v * 0x07c4acddu) >> 27];
 }
 
+inline u32 highest_bit_position(u64 v) {
+    u32 high = (u32)(v >> 32);
+    if (high)
+        return 32 + highest_bit_position(high);
+    return highest_bit_position((u32)v);
+}
 
-// partition the range into several subranges, where each subrange contains as
-// few coordinates as possible that are outside its rectangle
-static void partition_range(u32 xmin, u32 ymin, u32 xmax, u32 ymax,
-                            vector<pair<u32,u32>> &ranges)
-{
-    assert(xmin <= xmax);
-    assert(ymin <= ymax);
-    u32 min = interleave(xmin, ymin);
-    u32 max = interleave(xmax, ymax);
-    assert(min <= max);
-
-    // don't bother subdividing if the z-range is only slightly larger than the
-    // area we care about (which is the minimum bound for the z-range)
-    u32 zrange = max - min + 1;
-    u32 area = (xmax - xmin + 1) * (ymax - ymin + 1);
-    if (zrange <= (u32)(area * 1.1) + 4) {
-        ranges.push_back(make_pair(min, max));
-        return;
-    }
-
-    // calculate LITMAX and BIGMIN, which are the end and start respectively,
-    // of the less wasteful subranges (which we will try to partition in turn)
-    u32 litmax_x, litmax_y;
-    u32 bigmin_x, bigmin_y;
 
-    u32 first_diffbit = highest_bit_position(min ^ max);
-    if (first_diffbit & 1) {
-        // highest differing bit is an y bit, so split along a horizontal line
-        first_diffbit >>= 1;
-        u32 diffmask = 0xffff >> (16 - first_diffbit - 1);
-        u32 same_highbits = ~diffmask & ymin;
+// std::lower_bound without the hard to predict branch in the loop. the halving
+// compiles to a conditional move, so a search over a small array costs a few
+// cycles per level rather than a mispredict
+template<class Key>
+static const Key *branchless_lower_bound(const Key *begin, const Key *end, Key value) {
+    size_t n = end - begin;
+    if (n == 0)
+        return begin;
+    const Key *base = begin;
+    while (n > 1) {
+        size_t half = n / 2;
+        base = base[half - 1] < value ? base + half : base;
+        n -= half;
+    }
+    return base + (*base < value);
+}
 
-        litmax_x = xmax;
-        litmax_y = same_highbits | (diffmask >> 1);
 
-        bigmin_x = xmin;
-        bigmin_y = litmax_y + 1;
-    } else {
-        // highest differing bit is an x bit, so split along a vertical line
-        first_diffbit >>= 1;
-        u32 diffmask = 0xffff >> (16 - first_diffbit - 1);
-        u32 same_highbits = ~diffmask & xmin;
-        
-        litmax_x = same_highbits | (diffmask >> 1);
-        litmax_y = ymax;
-        
-        bigmin_x = litmax_x + 1;
-        bigmin_y = ymin;
+// find the first key in [begin, end) that is not less than value, probing
+// forward from begin in doubling steps before binary searching the bracket.
+// costs O(log(distance)) rather than O(log(end - begin)), which pays off when
+// consecutive searches land close together
+template<class Key>
+static const Key *gallop_lower_bound(const Key *begin, const Key *end, Key value) {
+    if (begin == end || *begin >= value)
+        return begin;
+    // invariant: *lo < value
+    const Key *lo = begin;
+    size_t step = 1;
+    for (;;) {
+        if (step >= (size_t)(end - lo))
+            return std::lower_bound(lo + 1, end, value);
+        const Key *probe = lo + step;
+        if (*probe >= value)
+            return std::lower_bound(lo + 1, probe, value);
+        lo = probe;
+        step <<= 1;
     }
-
-    partition_range(xmin, ymin, litmax_x, litmax_y, ranges);
-    partition_range(bigmin_x, bigmin_y, xmax, ymax, ranges);
 }
 
 
-
 inline u32 calc_block_size(u32 size) {
     u32 block_size = 1;
     size /= 8;
@@ -118,216 +289,3249 @@ inline u32 snap_min(u32 pos, u32 block_size) {
     return (pos / block_size) * block_size;
 }
 
+// last coordinate of the block containing pos. block_size is a power of two, so
+// this never goes past the end of the grid
 inline u32 snap_max(u32 pos, u32 block_size) {
-    if (pos == 0)
-        return block_size;
-    u32 r = pos % block_size;
-    if (r == block_size - 1)
-        return pos;
-    if (r == 0)
-        return pos - 1;
-    return (1 + pos / block_size) * block_size - 1;
+    return snap_min(pos, block_size) + (block_size - 1);
 }
 
 
-static const f32 gridDim = 5;
+// the factor that maps an extent of size onto the 0..65535 grid
+inline v2 discretize_scale(v2 size) {
+    return v2{65535.0f / size.x, 65535.0f / size.y};
+}
 
+// convert the real valued argument to a discrete representation in the lower
+// 16 bits of the result, clamping values outside the grid to its edges. the
+// batch encoders below must round exactly like this
+inline u32 discretize(f32 v, f32 min, f32 scale) {
+    f32 t = (v - min) * scale;
+    t = t < 0.0f ? 0.0f : t;
+    t = t > 65535.0f ? 65535.0f : t;
+    return (u32)t;
+}
 
-struct ZOrderIndex {
-    v2 minpos;
-    v2 maxpos;
-    v2 size;
-    vector<u32> zvalues;
-    vector<pair<u32,u32>> ranges;
 
-    ZOrderIndex() {
-        reset();
+static void compute_bounds_portable(const v2 *points, u32 count, v2 &min, v2 &max) {
+    for (u32 i = 0; i < count; ++i) {
+        v2 p = points[i];
+        if (p.x < min.x) min.x = p.x;
+        if (p.y < min.y) min.y = p.y;
+        if (p.x > max.x) max.x = p.x;
+        if (p.y > max.y) max.y = p.y;
     }
+}
 
-    void reset() {
-        minpos = v2{0,0};
-        maxpos = v2{0,0};
-        size = v2{0,0};
-        zvalues.clear();
-        ranges.clear();
+static void encode_points_portable(const v2 *points, u32 count, v2 minpos, v2 scale, u32 *keys) {
+    for (u32 i = 0; i < count; ++i) {
+        u32 x = discretize(points[i].x, minpos.x, scale.x);
+        u32 y = discretize(points[i].y, minpos.y, scale.y);
+        keys[i] = interleave(x, y);
     }
+}
 
-    // convert the real valued argument to a discrete representation
-    // in the lower 16 bits of the result
-    inline u32 discretize_x(f32 x) const {
-        return (u32)(((x - minpos.x) / size.x) * 65535.0f);
+
+#ifdef ZORDER_X86
+
+// the points are read as a flat x, y, x, y... float array. the reductions keep
+// x in the even lanes and y in the odd lanes until the very end
+
+ZORDER_TARGET_SSE2 static void compute_bounds_sse2(const v2 *points, u32 count, v2 &min, v2 &max) {
+    const f32 *f = (const f32 *)points;
+    __m128 vmin0 = _mm_setr_ps(min.x, min.y, min.x, min.y);
+    __m128 vmax0 = _mm_setr_ps(max.x, max.y, max.x, max.y);
+    __m128 vmin1 = vmin0;
+    __m128 vmax1 = vmax0;
+    u32 i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 a = _mm_loadu_ps(f + 2*i);
+        __m128 b = _mm_loadu_ps(f + 2*i + 4);
+        vmin0 = _mm_min_ps(vmin0, a);
+        vmax0 = _mm_max_ps(vmax0, a);
+        vmin1 = _mm_min_ps(vmin1, b);
+        vmax1 = _mm_max_ps(vmax1, b);
     }
-    // likewise for y coord
-    inline u32 discretize_y(f32 y) const {
-        return (u32)(((y - minpos.y) / size.y) * 65535.0f);
+    vmin0 = _mm_min_ps(vmin0, vmin1);
+    vmax0 = _mm_max_ps(vmax0, vmax1);
+    vmin0 = _mm_min_ps(vmin0, _mm_movehl_ps(vmin0, vmin0));
+    vmax0 = _mm_max_ps(vmax0, _mm_movehl_ps(vmax0, vmax0));
+    f32 lanes[4];
+    _mm_storeu_ps(lanes, vmin0);
+    min = v2{lanes[0], lanes[1]};
+    _mm_storeu_ps(lanes, vmax0);
+    max = v2{lanes[0], lanes[1]};
+    compute_bounds_portable(points + i, count - i, min, max);
+}
+
+ZORDER_TARGET_SSE2 static inline __m128i intersperse_zeroes_sse2(__m128i x) {
+    x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi32(x, 8)), _mm_set1_epi32(0x00ff00ff));
+    x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi32(x, 4)), _mm_set1_epi32(0x0f0f0f0f));
+    x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi32(x, 2)), _mm_set1_epi32(0x33333333));
+    x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi32(x, 1)), _mm_set1_epi32(0x55555555));
+    return x;
+}
+
+ZORDER_TARGET_SSE2 static void encode_points_sse2(const v2 *points, u32 count, v2 minpos, v2 scale, u32 *keys) {
+    const f32 *f = (const f32 *)points;
+    __m128 xmin = _mm_set1_ps(minpos.x);
+    __m128 ymin = _mm_set1_ps(minpos.y);
+    __m128 xscale = _mm_set1_ps(scale.x);
+    __m128 yscale = _mm_set1_ps(scale.y);
+    __m128 zero = _mm_setzero_ps();
+    __m128 limit = _mm_set1_ps(65535.0f);
+    u32 i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 a = _mm_loadu_ps(f + 2*i);
+        __m128 b = _mm_loadu_ps(f + 2*i + 4);
+        __m128 xs = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 ys = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        __m128 xt = _mm_mul_ps(_mm_sub_ps(xs, xmin), xscale);
+        __m128 yt = _mm_mul_ps(_mm_sub_ps(ys, ymin), yscale);
+        __m128i x = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(xt, zero), limit));
+        __m128i y = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(yt, zero), limit));
+        __m128i z = _mm_or_si128(intersperse_zeroes_sse2(x),
+                                 _mm_slli_epi32(intersperse_zeroes_sse2(y), 1));
+        _mm_storeu_si128((__m128i *)(keys + i), z);
     }
+    encode_points_portable(points + i, count - i, minpos, scale, keys + i);
+}
 
-    inline v2 from_z(u32 z) const {
-        u32 x = deinterleave_x(z);
-        u32 y = deinterleave_y(z);
-        v2 p;
-        p.x = minpos.x + size.x * ((float)x / 65535.0f);
-        p.y = minpos.y + size.y * ((float)y / 65535.0f);
-        return p;
+ZORDER_TARGET_AVX2 static void compute_bounds_avx2(const v2 *points, u32 count, v2 &min, v2 &max) {
+    const f32 *f = (const f32 *)points;
+    __m256 vmin0 = _mm256_setr_ps(min.x, min.y, min.x, min.y, min.x, min.y, min.x, min.y);
+    __m256 vmax0 = _mm256_setr_ps(max.x, max.y, max.x, max.y, max.x, max.y, max.x, max.y);
+    __m256 vmin1 = vmin0;
+    __m256 vmax1 = vmax0;
+    u32 i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 a = _mm256_loadu_ps(f + 2*i);
+        __m256 b = _mm256_loadu_ps(f + 2*i + 8);
+        vmin0 = _mm256_min_ps(vmin0, a);
+        vmax0 = _mm256_max_ps(vmax0, a);
+        vmin1 = _mm256_min_ps(vmin1, b);
+        vmax1 = _mm256_max_ps(vmax1, b);
     }
+    vmin0 = _mm256_min_ps(vmin0, vmin1);
+    vmax0 = _mm256_max_ps(vmax0, vmax1);
+    __m128 vmin = _mm_min_ps(_mm256_castps256_ps128(vmin0), _mm256_extractf128_ps(vmin0, 1));
+    __m128 vmax = _mm_max_ps(_mm256_castps256_ps128(vmax0), _mm256_extractf128_ps(vmax0, 1));
+    vmin = _mm_min_ps(vmin, _mm_movehl_ps(vmin, vmin));
+    vmax = _mm_max_ps(vmax, _mm_movehl_ps(vmax, vmax));
+    f32 lanes[4];
+    _mm_storeu_ps(lanes, vmin);
+    min = v2{lanes[0], lanes[1]};
+    _mm_storeu_ps(lanes, vmax);
+    max = v2{lanes[0], lanes[1]};
+    compute_bounds_portable(points + i, count - i, min, max);
+}
 
-    inline v2 clamp(v2 p) const {
-        if (p.x < minpos.x) p.x = minpos.x;
-        if (p.y < minpos.y) p.y = minpos.y;
-        if (p.x > maxpos.x) p.x = maxpos.x;
-        if (p.y > maxpos.y) p.y = maxpos.y;
-        return p;
+ZORDER_TARGET_AVX2 static inline __m256i intersperse_zeroes_avx2(__m256i x) {
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 8)), _mm256_set1_epi32(0x00ff00ff));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 4)), _mm256_set1_epi32(0x0f0f0f0f));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 2)), _mm256_set1_epi32(0x33333333));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 1)), _mm256_set1_epi32(0x55555555));
+    return x;
+}
+
+ZORDER_TARGET_AVX2 static void encode_points_avx2(const v2 *points, u32 count, v2 minpos, v2 scale, u32 *keys) {
+    const f32 *f = (const f32 *)points;
+    __m256 xmin = _mm256_set1_ps(minpos.x);
+    __m256 ymin = _mm256_set1_ps(minpos.y);
+    __m256 xscale = _mm256_set1_ps(scale.x);
+    __m256 yscale = _mm256_set1_ps(scale.y);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 limit = _mm256_set1_ps(65535.0f);
+    u32 i = 0;
+    for (; i + 8 <= count; i += 8) {
+        // the in-lane shuffles leave the points in 0 1 4 5 2 3 6 7 order,
+        // which the final cross-lane permute undoes
+        __m256 a = _mm256_loadu_ps(f + 2*i);
+        __m256 b = _mm256_loadu_ps(f + 2*i + 8);
+        __m256 xs = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        __m256 ys = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        __m256 xt = _mm256_mul_ps(_mm256_sub_ps(xs, xmin), xscale);
+        __m256 yt = _mm256_mul_ps(_mm256_sub_ps(ys, ymin), yscale);
+        __m256i x = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(xt, zero), limit));
+        __m256i y = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(yt, zero), limit));
+        __m256i z = _mm256_or_si256(intersperse_zeroes_avx2(x),
+                                    _mm256_slli_epi32(intersperse_zeroes_avx2(y), 1));
+        z = _mm256_permute4x64_epi64(z, _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i *)(keys + i), z);
     }
+    encode_points_portable(points + i, count - i, minpos, scale, keys + i);
+}
 
-    inline bool is_size_valid() const {
-        return fabs(size.x) > 0.01f && fabs(size.y) > 0.01f;
+#endif
+
+
+// find the bounding box of the points
+static void compute_bounds(const v2 *points, u32 count, v2 &min, v2 &max) {
+    min = v2{FLT_MAX, FLT_MAX};
+    max = v2{-FLT_MAX, -FLT_MAX};
+#ifdef ZORDER_X86
+    if (use_avx2)
+        return compute_bounds_avx2(points, count, min, max);
+    if (use_sse2)
+        return compute_bounds_sse2(points, count, min, max);
+#endif
+    compute_bounds_portable(points, count, min, max);
+}
+
+// discretize and interleave each point into keys[i]
+static void encode_points(const v2 *points, u32 count, v2 minpos, v2 scale, u32 *keys) {
+#ifdef ZORDER_X86
+    if (use_avx2)
+        return encode_points_avx2(points, count, minpos, scale, keys);
+    if (use_sse2)
+        return encode_points_sse2(points, count, minpos, scale, keys);
+#endif
+    encode_points_portable(points, count, minpos, scale, keys);
+}
+
+
+// discretization for 64 bit keys happens in double precision, since a float
+// can't address 32 bits worth of grid cells
+struct dv2 {
+    f64 x, y;
+};
+
+inline u32 discretize64(f32 v, f32 min, f64 scale) {
+    f64 t = ((f64)v - (f64)min) * scale;
+    t = t < 0.0 ? 0.0 : t;
+    t = t > 4294967295.0 ? 4294967295.0 : t;
+    return (u32)t;
+}
+
+static void encode_points64(const v2 *points, u32 count, v2 minpos, dv2 scale, u64 *keys) {
+    for (u32 i = 0; i < count; ++i) {
+        u32 x = discretize64(points[i].x, minpos.x, scale.x);
+        u32 y = discretize64(points[i].y, minpos.y, scale.y);
+        keys[i] = interleave64(x, y);
     }
+}
 
-    void make_index(const vector<v2> &points) {
-        zvalues.clear();
-        v2 min = v2 {FLT_MAX, FLT_MAX};
-        v2 max = v2 {FLT_MIN, FLT_MIN};
-        for (v2 p : points) {
-            if (p.x < min.x) min.x = p.x;
-            if (p.y < min.y) min.y = p.y;
-            if (p.x > max.x) max.x = p.x;
-            if (p.y > max.y) max.y = p.y;
-        }
-        minpos = min;
-        maxpos = max;
-        size = max - min;
-        if (!is_size_valid()) {
-            puts("invalid size!");
+
+// everything that depends on the key width, so the rest of the code can be
+// written once for u32 keys (16 bits per axis) and u64 keys (32 bits per axis)
+template<class Key> struct Morton;
+
+template<> struct Morton<u32> {
+    typedef f32 Real;
+    typedef v2 Scale;
+    static const u32 axis_bits = 16;
+    static const u32 coord_max = 0xffff;
+
+    static u32 interleave(u32 x, u32 y) { return zorder::interleave(x, y); }
+    static u32 deinterleave_x(u32 z) { return zorder::deinterleave_x(z); }
+    static u32 deinterleave_y(u32 z) { return zorder::deinterleave_y(z); }
+    // the x bits of a key, and a coordinate spread out to their positions
+    static u32 x_bits() { return 0x55555555; }
+    static u32 intersperse(u32 v) { return intersperse_zeroes(v); }
+
+    static Scale discretize_scale(v2 size) { return zorder::discretize_scale(size); }
+    static u32 discretize(f32 v, f32 min, f32 scale) { return zorder::discretize(v, min, scale); }
+    static void encode_points(const v2 *points, u32 count, v2 minpos, Scale scale, u32 *keys) {
+        zorder::encode_points(points, count, minpos, scale, keys);
+    }
+};
+
+template<> struct Morton<u64> {
+    typedef f64 Real;
+    typedef dv2 Scale;
+    static const u32 axis_bits = 32;
+    static const u32 coord_max = 0xffffffff;
+
+    static u64 interleave(u32 x, u32 y) { return interleave64(x, y); }
+    static u32 deinterleave_x(u64 z) { return deinterleave_x64(z); }
+    static u32 deinterleave_y(u64 z) { return deinterleave_y64(z); }
+    static u64 x_bits() { return 0x5555555555555555ull; }
+    static u64 intersperse(u32 v) { return intersperse_zeroes64(v); }
+
+    static Scale discretize_scale(v2 size) {
+        return dv2{4294967295.0 / size.x, 4294967295.0 / size.y};
+    }
+    static u32 discretize(f32 v, f32 min, f64 scale) { return discretize64(v, min, scale); }
+    static void encode_points(const v2 *points, u32 count, v2 minpos, Scale scale, u64 *keys) {
+        encode_points64(points, count, minpos, scale, keys);
+    }
+};
+
+
+// append r to the ranges, which are in ascending order and don't overlap. once
+// max_ranges is reached, the two neighbours with the smallest gap between them
+// are merged to make room, since that adds the fewest keys to the search
+template<class Key>
+static void append_range(pair<Key,Key> *ranges, u32 &count, u32 max_ranges, pair<Key,Key> r) {
+    assert(max_ranges > 0);
+    if (count > 0) {
+        assert(r.first > ranges[count - 1].second);
+        if (r.first - ranges[count - 1].second == 1) {
+            ranges[count - 1].second = r.second;
             return;
         }
-        for (v2 p : points) {
-            u32 x = discretize_x(p.x);
-            u32 y = discretize_y(p.y);
-            u32 z = interleave(x, y);
-            zvalues.push_back(z);
+    }
+    if (count == max_ranges) {
+        // the gap in front of r is a candidate too
+        u32 best = count;
+        Key best_gap = r.first - ranges[count - 1].second;
+        for (u32 i = 1; i < count; ++i) {
+            Key gap = ranges[i].first - ranges[i - 1].second;
+            if (gap < best_gap) {
+                best_gap = gap;
+                best = i;
+            }
+        }
+        if (best == count) {
+            ranges[count - 1].second = r.second;
+            return;
         }
-        std::sort(zvalues.begin(), zvalues.end());
-        printf("zvalues.size(): %d\n", (int)zvalues.size());
-        printf("size.x: %.1f\n", size.x);
-        printf("size.y: %.1f\n", size.y);
-        printf("minpos.x: %.1f\n", minpos.x);
-        printf("minpos.y: %.1f\n", minpos.y);
-        printf("maxpos.x: %.1f\n", maxpos.x);
-        printf("maxpos.y: %.1f\n", maxpos.y);
+        ranges[best - 1].second = ranges[best].second;
+        for (u32 i = best; i + 1 < count; ++i)
+            ranges[i] = ranges[i + 1];
+        --count;
+    }
+    ranges[count++] = r;
+}
+
+
+// how a rectangle of cells relates to the shape being searched for
+enum ShapeOverlap {
+    shape_outside,
+    shape_partial,
+    shape_inside
+};
+
+// the whole query rectangle is wanted
+struct RectShape {
+    ShapeOverlap classify(u32, u32, u32, u32) const {
+        return shape_inside;
     }
+};
 
-    void area_lookup(v2 p0, v2 p1, vector<u32> &result) {
-        result.clear();
-        if (zvalues.empty() || !is_size_valid()) {
-            puts("no lookup!");
+// a circle, tested against cells with integer math only. the squared
+// distances are weighted sums of gaps counted in cells, so that the circle
+// may be an ellipse on the grid, and the weights and thresholds are rounded
+// so that a cell is only called outside or inside when it certainly is.
+// the border cells hold the clamped points, so they reach on to infinity and
+// are never inside
+struct CircleShape {
+    i64 cx, cy;            // the cell of the centre
+    u32 shift;             // gaps are counted in units of 1 << shift cells
+    u64 gap_limit;         // ...and can't be larger than this
+    u64 wx_lo, wy_lo;      // the weights rounded down, for the outside test
+    u64 wx_hi, wy_hi;      // ...and rounded up, for the inside test
+    u64 outside_sq;        // cells further away than this are outside
+    u64 inside_sq;         // cells nearer than this all the way are inside
+    u32 coord_max;
+
+    // the same test for the vector scans of 32 bit keys, done on 16 bit
+    // lanes. gaps are cut off at 32767 cells, and scaled by the weights to
+    // units a little larger than a cell, which keeps the sums of the squares
+    // in 31 bits
+    i32 lane_cx, lane_cy;
+    u16 lane_wx_lo, lane_wy_lo;
+    u16 lane_wx_hi, lane_wy_hi;
+    i32 lane_outside_sq;
+    i32 lane_inside_sq;
+
+    // a circle of radius around the point (cx, cy) in cell units, where the
+    // cells are cell_x by cell_y in size. distances within slack of the radius
+    // are left to the exact test
+    CircleShape(f64 centre_x, f64 centre_y, f64 cell_x, f64 cell_y, f64 radius, f64 slack, u32 coord_max)
+        : coord_max(coord_max)
+    {
+        const f64 far = 1099511627776.0; // 2^40
+        const u64 sq_max = (u64)1 << 62;
+        shift = 0;
+        gap_limit = (1 << 15) - 1;
+        if (!(fabs(centre_x) < far && fabs(centre_y) < far && radius + slack < far * min(cell_x, cell_y))) {
+            // off the grid, so every cell is partial
+            cx = cy = 0;
+            wx_lo = wy_lo = 0;
+            wx_hi = wy_hi = 1;
+            outside_sq = sq_max;
+            inside_sq = 0;
+            lane_cx = lane_cy = 0;
+            lane_wx_lo = lane_wy_lo = 0;
+            lane_wx_hi = lane_wy_hi = 1;
+            lane_outside_sq = 0x7fffffff;
+            lane_inside_sq = -1;
             return;
         }
+        cx = (i64)floor(centre_x);
+        cy = (i64)floor(centre_y);
 
-        p0 = clamp(p0);
-        p1 = clamp(p1);
-        u32 xmin = discretize_x(p0.x);
-        u32 ymin = discretize_y(p0.y);
-        u32 xmax = discretize_x(p1.x);
-        u32 ymax = discretize_y(p1.y);
-        if (xmax < xmin) swap(xmin, xmax);
-        if (ymax < ymin) swap(ymin, ymax);
-        assert(xmin <= xmax);
-        assert(ymin <= ymax);
+        // a centre further off than this is more than 32767 cells from any
+        // of them either way
+        const i64 lane_far = 1 << 20;
+        lane_cx = (i32)(cx < -lane_far ? -lane_far : cx > lane_far ? lane_far : cx);
+        lane_cy = (i32)(cy < -lane_far ? -lane_far : cy > lane_far ? lane_far : cy);
+        f64 unit = max(cell_x, cell_y) * (65536.0 / 65533.0);
+        lane_wx_lo = (u16)floor(65536 * cell_x / unit);
+        lane_wy_lo = (u16)floor(65536 * cell_y / unit);
+        lane_wx_hi = (u16)min(ceil(65536 * cell_x / unit), 65534.0);
+        lane_wy_hi = (u16)min(ceil(65536 * cell_y / unit), 65534.0);
+        const f64 lane_sq_max = 2147483647.0 - 2;
+        f64 lane_outer = (radius + slack) / unit * ((radius + slack) / unit);
+        lane_outside_sq = lane_outer >= lane_sq_max ? 0x7fffffff : (i32)ceil(lane_outer) + 1;
+        f64 lane_inner = radius > slack ? (radius - slack) / unit * ((radius - slack) / unit) : 0;
+        lane_inside_sq = lane_inner >= lane_sq_max ? 0x7fffffff : lane_inner >= 1 ? (i32)floor(lane_inner) - 1 : -1;
 
-        printf("p0.x: %.1f\n", p0.x);
-        printf("p0.y: %.1f\n", p0.y);
-        printf("p1.x: %.1f\n", p1.x);
-        printf("p1.y: %.1f\n", p1.y);
-        printf("xmin: %u\n", xmin);
-        printf("ymin: %u\n", ymin);
-        printf("xmax: %u\n", xmax);
-        printf("ymax: %u\n", ymax);
+        // the gaps within the circle's bounding box, squared, must fit in 30
+        // bits for the sums not to overflow
+        f64 extent = (radius + slack) / min(cell_x, cell_y) + 4;
+        while (extent * 2 >= (f64)((u64)1 << (14 + shift)))
+            ++shift;
+        f64 ux = cell_x * (f64)((u64)1 << shift);
+        f64 uy = cell_y * (f64)((u64)1 << shift);
+        f64 k = (f64)(1 << 30) / (max(ux, uy) * max(ux, uy));
+        wx_lo = (u64)floor(ux * ux * k);
+        wy_lo = (u64)floor(uy * uy * k);
+        wx_hi = (u64)ceil(ux * ux * k) + 1;
+        wy_hi = (u64)ceil(uy * uy * k) + 1;
 
-        /*SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255);
-        debug_draw_range(make_pair(interleave(xmin, ymin), interleave(xmax, ymax)));*/
+        f64 outer = (radius + slack) * (radius + slack) * k;
+        outside_sq = outer >= (f64)sq_max ? sq_max : (u64)ceil(outer) + 1;
+        f64 inner = radius > slack ? (radius - slack) * (radius - slack) * k : 0;
+        inside_sq = inner >= (f64)sq_max ? sq_max : inner >= 1 ? (u64)floor(inner) - 1 : 0;
+    }
 
-        // snap to a suitable power of two block size (which may cause us to search a larger
-        // area than necessary, but it reduces the number of ranges we need to search)
-        u32 xblock = calc_block_size(xmax - xmin);
-        u32 yblock = calc_block_size(ymax - ymin);
-        u32 block = max(xblock, yblock);
-        u32 xmin2 = snap_min(xmin, block);
-        u32 ymin2 = snap_min(ymin, block);
-        u32 xmax2 = snap_max(xmax, block);
-        u32 ymax2 = snap_max(ymax, block);
+    // cells are placed within a cell of where the keys put them, so that
+    // rounding in the discretization doesn't matter, which together with the
+    // centre being anywhere in its cell takes two cells off or on each gap
+    ShapeOverlap classify(u32 xmin, u32 ymin, u32 xmax, u32 ymax) const {
+        u64 near_x = min(near_gap(xmin, xmax, cx) >> shift, gap_limit);
+        u64 near_y = min(near_gap(ymin, ymax, cy) >> shift, gap_limit);
+        if (near_x * near_x * wx_lo + near_y * near_y * wy_lo > outside_sq)
+            return shape_outside;
+        if (xmin == 0 || ymin == 0 || xmax == coord_max || ymax == coord_max)
+            return shape_partial;
+        u64 round = ((u64)1 << shift) - 1;
+        u64 far_x = (max(abs_gap(xmin, cx), abs_gap(xmax, cx)) + 2 + round) >> shift;
+        u64 far_y = (max(abs_gap(ymin, cy), abs_gap(ymax, cy)) + 2 + round) >> shift;
+        if (far_x > gap_limit || far_y > gap_limit)
+            return shape_partial;
+        if (far_x * far_x * wx_hi + far_y * far_y * wy_hi <= inside_sq)
+            return shape_inside;
+        return shape_partial;
+    }
+
+    // classify for a single cell, without branches, since which side of the
+    // centre the cells of the keys are on is anyone's guess
+    ShapeOverlap classify_cell(u32 x, u32 y) const {
+        i64 dx = (i64)x - cx;
+        i64 dy = (i64)y - cy;
+        u64 gap_x = (u64)(dx < 0 ? -dx : dx);
+        u64 gap_y = (u64)(dy < 0 ? -dy : dy);
+        bool open_x = (x == 0 && dx > 0) || (x == coord_max && dx < 0);
+        bool open_y = (y == 0 && dy > 0) || (y == coord_max && dy < 0);
+        u64 near_x = min((open_x || gap_x <= 2 ? 0 : gap_x - 2) >> shift, gap_limit);
+        u64 near_y = min((open_y || gap_y <= 2 ? 0 : gap_y - 2) >> shift, gap_limit);
+        u64 round = ((u64)1 << shift) - 1;
+        u64 far_x = (gap_x + 2 + round) >> shift;
+        u64 far_y = (gap_y + 2 + round) >> shift;
+        bool outside = near_x * near_x * wx_lo + near_y * near_y * wy_lo > outside_sq;
+        bool inside = (x != 0) & (y != 0) & (x != coord_max) & (y != coord_max) &
+                      (far_x <= gap_limit) & (far_y <= gap_limit) &
+                      (far_x * far_x * wx_hi + far_y * far_y * wy_hi <= inside_sq);
+        // a cell inside is never outside
+        return (ShapeOverlap)(shape_partial - outside + inside);
+    }
+
+    static u64 abs_gap(u32 v, i64 c) {
+        return (i64)v < c ? (u64)(c - (i64)v) : (u64)((i64)v - c);
+    }
+
+    // the distance from c to the nearest of the cells min..max, where the
+    // border cells reach away from the grid
+    u64 near_gap(u32 lo, u32 hi, i64 c) const {
+        if (c < (i64)lo)
+            return lo == 0 || (i64)lo - c <= 2 ? 0 : (u64)((i64)lo - c - 2);
+        if (c > (i64)hi)
+            return hi == coord_max || c - (i64)hi <= 2 ? 0 : (u64)(c - (i64)hi - 2);
+        return 0;
+    }
+};
 
-        ranges.clear();
-        partition_range(xmin2, ymin2, xmax2, ymax2, ranges);
-        std::sort(ranges.begin(), ranges.end());
-        printf("range count: %d, block: %u\n", (int)ranges.size(), block);
+// partition the range into several subranges, where each subrange contains as
+// few coordinates as possible that are outside its rectangle. the subranges are
+// written to ranges in ascending order, merging the closest ones if there would
+// be more than max_ranges. returns the number of ranges written.
+// parts of the rectangle that lie outside shape are left out. those that are
+// partially inside are split further until they are no larger than min_split
+// cells on either axis, even where their z-range is already tight
+template<class Key, class Shape>
+static u32 partition_range(u32 xmin, u32 ymin, u32 xmax, u32 ymax,
+                           pair<Key,Key> *ranges, u32 max_ranges,
+                           const Shape &shape, u32 min_split)
+{
+    typedef Morton<Key> M;
+    struct Rect {
+        u32 xmin, ymin, xmax, ymax;
+    };
+
+    // each split lowers the highest differing bit between the corners, so the
+    // depth can't exceed the number of key bits. the lower half is pushed last,
+    // which makes the ranges come out in ascending order
+    Rect stack[sizeof(Key) * 8 + 1];
+    u32 depth = 0;
+    u32 count = 0;
+    stack[depth++] = Rect{xmin, ymin, xmax, ymax};
 
-        assert(!ranges.empty());
-        assert(ranges[0].second >= ranges[0].first);
-        for (u32 i = 1; i < ranges.size(); ++i) {
-            assert(ranges[i].second >= ranges[i].first);
-            assert(ranges[i].first > ranges[i-1].second);
+    while (depth > 0) {
+        Rect r = stack[--depth];
+        assert(r.xmin <= r.xmax);
+        assert(r.ymin <= r.ymax);
+        ShapeOverlap overlap = shape.classify(r.xmin, r.ymin, r.xmax, r.ymax);
+        if (overlap == shape_outside)
+            continue;
+        Key min = M::interleave(r.xmin, r.ymin);
+        Key max = M::interleave(r.xmax, r.ymax);
+        assert(min <= max);
+
+        // don't bother subdividing if the z-range is only slightly larger than
+        // the area we care about (which is the minimum bound for the z-range).
+        // done in floating point since neither fits the key type for the
+        // largest rectangles
+        f64 zrange = (f64)(max - min) + 1;
+        f64 area = ((f64)(r.xmax - r.xmin) + 1) * ((f64)(r.ymax - r.ymin) + 1);
+        bool small = r.xmax - r.xmin < min_split && r.ymax - r.ymin < min_split;
+        if (zrange <= area * 1.1 + 4 && (overlap == shape_inside || small || min == max)) {
+            append_range(ranges, count, max_ranges, make_pair(min, max));
+            continue;
         }
 
-        //u32 c = 21;
-        auto zindex_begin = zvalues.begin();
-        auto zsearch_start = zvalues.begin();
-        auto zsearch_end = std::upper_bound(zvalues.begin(), zvalues.end(), ranges.back().second);
+        // calculate LITMAX and BIGMIN, which are the end and start respectively,
+        // of the less wasteful subranges (which we will try to partition in turn)
+        u32 litmax_x, litmax_y;
+        u32 bigmin_x, bigmin_y;
 
-        for (auto r : ranges) {
-            //if (zsearch_start == zsearch_end)
-            //    break;
+        u32 first_diffbit = highest_bit_position(min ^ max);
+        if (first_diffbit & 1) {
+            // highest differing bit is an y bit, so split along a horizontal line
+            first_diffbit >>= 1;
+            u32 diffmask = M::coord_max >> (M::axis_bits - first_diffbit - 1);
+            u32 same_highbits = ~diffmask & r.ymin;
 
-            /*c += 21;
-            SDL_SetRenderDrawColor(renderer, c, c, c, 255);
-            debug_draw_range(r);*/
+            litmax_x = r.xmax;
+            litmax_y = same_highbits | (diffmask >> 1);
 
-            auto it = std::lower_bound(zsearch_start, zsearch_end, r.first);
+            bigmin_x = r.xmin;
+            bigmin_y = litmax_y + 1;
+        } else {
+            // highest differing bit is an x bit, so split along a vertical line
+            first_diffbit >>= 1;
+            u32 diffmask = M::coord_max >> (M::axis_bits - first_diffbit - 1);
+            u32 same_highbits = ~diffmask & r.xmin;
 
-            for (; it != zsearch_end && *it <= r.second; ++it) {
-                u32 x = deinterleave_x(*it);
-                if (x < xmin || x > xmax)
-                    continue;
-                u32 y = deinterleave_y(*it);
-                if (y < ymin || y > ymax)
-                    continue;
-                u32 index = it - zindex_begin;
-                printf("found: %u, %u (at %u)\n", x, y, index);
-                result.push_back(index);
-            }
+            litmax_x = same_highbits | (diffmask >> 1);
+            litmax_y = r.ymax;
 
-            zsearch_start = it;
+            bigmin_x = litmax_x + 1;
+            bigmin_y = r.ymin;
         }
 
-        /*SDL_SetRenderDrawColor(renderer, 128, 128, 128, 255);
-        debug_draw_rect(xmin, ymin, xmax, ymax);
+        assert(depth + 2 <= sizeof(stack) / sizeof(stack[0]));
+        stack[depth++] = Rect{bigmin_x, bigmin_y, r.xmax, r.ymax};
+        stack[depth++] = Rect{r.xmin, r.ymin, litmax_x, litmax_y};
+    }
 
-        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-        debug_draw_rect(orig_xmin, orig_ymin, orig_xmax, orig_ymax);*/
+    return count;
+}
+
+
+// LSD radix sort of keys with 11 bit digits (three passes for 32 bit keys, six
+// for 64 bit keys), carrying values along so they end up in the same
+// permutation. all histograms are gathered in a single read pass, and any pass
+// whose digit is the same for every key is skipped. the scratch vectors are
+// resized to match and may end up swapped with the inputs
+template<class Key>
+static void radix_sort(vector<Key> &keys, vector<u32> &values,
+                       vector<Key> &key_scratch, vector<u32> &value_scratch)
+{
+    const u32 digit_bits = 11;
+    const u32 bucket_count = 1 << digit_bits;
+    const u32 digit_mask = bucket_count - 1;
+    const u32 pass_count = (sizeof(Key) * 8 + digit_bits - 1) / digit_bits;
+
+    u32 count = (u32)keys.size();
+    assert(values.size() == count);
+    if (count < 2)
+        return;
+    key_scratch.resize(count);
+    value_scratch.resize(count);
+
+    u32 histograms[pass_count][bucket_count];
+    memset(histograms, 0, sizeof(histograms));
+    for (u32 i = 0; i < count; ++i) {
+        Key key = keys[i];
+        for (u32 pass = 0; pass < pass_count; ++pass)
+            ++histograms[pass][(key >> (pass * digit_bits)) & digit_mask];
     }
 
+    Key *src_keys = keys.data();
+    u32 *src_values = values.data();
+    Key *dst_keys = key_scratch.data();
+    u32 *dst_values = value_scratch.data();
+    for (u32 pass = 0; pass < pass_count; ++pass) {
+        u32 *histogram = histograms[pass];
+        u32 shift = pass * digit_bits;
+        if (histogram[(src_keys[0] >> shift) & digit_mask] == count)
+            continue;
 
-    /*void debug_draw_range(pair<u32,u32> r) {
-        u32 zprev = r.first;
-        for (u32 z = zprev + 1; z <= r.second; zprev = z++) {
-            v2 p0 = from_z(zprev) * gridDim;
-            v2 p1 = from_z(z) * gridDim;
-            SDL_RenderDrawLine(renderer, (u32)p0.x, (u32)p0.y, (u32)p1.x, (u32)p1.y);
+        // turn the counts into starting offsets
+        u32 sum = 0;
+        for (u32 b = 0; b < bucket_count; ++b) {
+            u32 c = histogram[b];
+            histogram[b] = sum;
+            sum += c;
         }
+        for (u32 i = 0; i < count; ++i) {
+            Key key = src_keys[i];
+            u32 pos = histogram[(key >> shift) & digit_mask]++;
+            dst_keys[pos] = key;
+            dst_values[pos] = src_values[i];
+        }
+        swap(src_keys, dst_keys);
+        swap(src_values, dst_values);
     }
 
-    void debug_draw_rect(u32 xmin, u32 ymin, u32 xmax, u32 ymax) {
-        u32 zmin = interleave(xmin, ymin);
-        u32 zmax = interleave(xmax, ymax);
-        v2 p0 = from_z(zmin) * gridDim;
-        v2 p1 = from_z(zmax) * gridDim;
-        SDL_Rect rect;
-        rect.x = p0.x;
-        rect.y = p0.y;
-        rect.w = p1.x - p0.x;
-        rect.h = p1.y - p0.y;
-        SDL_RenderDrawRect(renderer, &rect);
-    }*/
-};
+    if (src_keys != keys.data()) {
+        keys.swap(key_scratch);
+        values.swap(value_scratch);
+    }
+}
+
+
+// radix_sort spread over the threads of pool. the keys are cut into one block
+// per thread, and each digit pass counts the digits of every block, turns the
+// counts into offsets for each (bucket, block) pair and scatters the blocks at
+// the same time. a block's keys go after those of the blocks before it in
+// every bucket, so the sort stays stable. histograms is scratch space
+template<class Key>
+static void parallel_radix_sort(WorkerPool &pool, vector<Key> &keys, vector<u32> &values,
+                                vector<Key> &key_scratch, vector<u32> &value_scratch,
+                                vector<u32> &histograms)
+{
+    const u32 digit_bits = 11;
+    const u32 bucket_count = 1 << digit_bits;
+    const u32 digit_mask = bucket_count - 1;
+    const u32 pass_count = (sizeof(Key) * 8 + digit_bits - 1) / digit_bits;
+
+    u32 count = (u32)keys.size();
+    assert(values.size() == count);
+    if (count < 2)
+        return;
+    key_scratch.resize(count);
+    value_scratch.resize(count);
+
+    u32 block_size = (count + pool.size() - 1) / pool.size();
+    u32 block_count = (count + block_size - 1) / block_size;
+    histograms.resize(block_count * bucket_count);
+
+    Key *src_keys = keys.data();
+    u32 *src_values = values.data();
+    Key *dst_keys = key_scratch.data();
+    u32 *dst_values = value_scratch.data();
+    for (u32 pass = 0; pass < pass_count; ++pass) {
+        u32 shift = pass * digit_bits;
+        pool.parallel_for(count, block_size, [&](u32, u32 begin, u32 end) {
+            u32 *histogram = &histograms[begin / block_size * bucket_count];
+            memset(histogram, 0, bucket_count * sizeof(u32));
+            for (u32 i = begin; i < end; ++i)
+                ++histogram[(src_keys[i] >> shift) & digit_mask];
+        });
+
+        // turn the counts into starting offsets, bucket by bucket and within
+        // each bucket block by block
+        u32 sum = 0;
+        bool constant = false;
+        for (u32 b = 0; b < bucket_count; ++b) {
+            u32 bucket_start = sum;
+            for (u32 block = 0; block < block_count; ++block) {
+                u32 &slot = histograms[block * bucket_count + b];
+                u32 c = slot;
+                slot = sum;
+                sum += c;
+            }
+            if (sum - bucket_start == count)
+                constant = true;
+        }
+        if (constant)
+            continue;
+
+        pool.parallel_for(count, block_size, [&](u32, u32 begin, u32 end) {
+            u32 *histogram = &histograms[begin / block_size * bucket_count];
+            for (u32 i = begin; i < end; ++i) {
+                Key key = src_keys[i];
+                u32 pos = histogram[(key >> shift) & digit_mask]++;
+                dst_keys[pos] = key;
+                dst_values[pos] = src_values[i];
+            }
+        });
+        swap(src_keys, dst_keys);
+        swap(src_values, dst_values);
+    }
+
+    if (src_keys != keys.data()) {
+        keys.swap(key_scratch);
+        values.swap(value_scratch);
+    }
+}
+
+
+static const f32 gridDim = 5;
+
+
+// an inclusive rectangle of grid cells
+struct CellRect {
+    u32 xmin, ymin, xmax, ymax;
+};
+
+
+// a rectangle of cells tested without deinterleaving keys: the x bits masked
+// out of a key are in the same order as x, and so are the y bits shifted down
+// onto them, so they can be compared with the interspersed bounds directly
+template<class Key>
+struct MortonRect {
+    typedef Morton<Key> M;
+    Key xmin, ymin, xmax, ymax;
+
+    explicit MortonRect(const CellRect &cells) {
+        xmin = M::intersperse(cells.xmin);
+        ymin = M::intersperse(cells.ymin);
+        xmax = M::intersperse(cells.xmax);
+        ymax = M::intersperse(cells.ymax);
+    }
+
+    bool contains(Key z) const {
+        Key x = z & M::x_bits();
+        Key y = (z >> 1) & M::x_bits();
+        return (x >= xmin) & (x <= xmax) & (y >= ymin) & (y <= ymax);
+    }
+};
+
+// keep ids[i] for each keys[i] inside cells, up to the first key past last.
+// returns where the scan stopped
+template<class Key>
+static const Key *scan_range_portable(const Key *keys, const Key *end, Key last, const CellRect &cells,
+                                      const u32 *ids, vector<u32> &result) {
+    MortonRect<Key> rect(cells);
+    const Key *it = keys;
+    for (; it != end && *it <= last; ++it) {
+        if (rect.contains(*it))
+            result.push_back(ids[it - keys]);
+    }
+    return it;
+}
+
+// what the split scans below collect over the ranges of a query. the vectors
+// are only ever grown, by doubling, and the counts say how much of them is
+// used, which saves clearing a window of both for each range
+struct SplitOutput {
+    vector<u32> *inside;
+    vector<u32> *edge;
+    size_t inside_count;
+    size_t edge_count;
+};
+
+// room for n more values after the first count of v
+inline u32 *grow_output(vector<u32> &v, size_t count, size_t n) {
+    if (v.size() < count + n)
+        v.resize(max(count + n, v.size() * 2));
+    return v.data();
+}
+
+// like scan_range_portable, but for a circle. the ids of keys in cells inside
+// inner, a square inside the circle, or else inside the circle, go to
+// out.inside, and those of keys in cells on its boundary to out.edge. keys in
+// cells outside it are dropped
+template<class Key>
+static const Key *scan_range_split_portable(const Key *keys, const Key *end, Key last, const CellRect &cells,
+                                            const CellRect &inner, const CircleShape &circle, const u32 *ids,
+                                            SplitOutput &out) {
+    typedef Morton<Key> M;
+    MortonRect<Key> rect(cells);
+    MortonRect<Key> square(inner);
+    const Key *it = keys;
+    for (; it != end && *it <= last; ++it) {
+        if (!rect.contains(*it))
+            continue;
+        ShapeOverlap overlap = shape_inside;
+        if (!square.contains(*it))
+            overlap = circle.classify_cell(M::deinterleave_x(*it), M::deinterleave_y(*it));
+        if (overlap == shape_inside) {
+            grow_output(*out.inside, out.inside_count, 1)[out.inside_count] = ids[it - keys];
+            ++out.inside_count;
+        } else if (overlap == shape_partial) {
+            grow_output(*out.edge, out.edge_count, 1)[out.edge_count] = ids[it - keys];
+            ++out.edge_count;
+        }
+    }
+    return it;
+}
+
+
+#ifdef ZORDER_X86
+
+// the vector scans test keys like MortonRect. the masked bits fit in 31 bits,
+// so the signed compares work on them, with bounds widened by one to make
+// them inclusive
+
+// for each 8 bit mask, the positions of its set bits packed into the low
+// bytes, and how many there are. compresses the ids selected by a mask to the
+// front of a vector with a single permute
+struct CompressTable {
+    u64 indices[256];
+    u8 counts[256];
+};
+
+static CompressTable make_compress_table() {
+    CompressTable table;
+    for (u32 mask = 0; mask < 256; ++mask) {
+        u64 indices = 0;
+        u32 count = 0;
+        for (u32 i = 0; i < 8; ++i) {
+            if (mask & (1 << i))
+                indices |= (u64)i << (8 * count++);
+        }
+        table.indices[mask] = indices;
+        table.counts[mask] = (u8)count;
+    }
+    return table;
+}
+
+static const CompressTable compress_table = make_compress_table();
+
+// the vector scans store the ids of a whole group of keys and keep as many
+// as passed, so result is grown once for a window of keys and written through
+// a pointer. a window has room for every key in it, which also covers the
+// group stored past the last kept id
+static const u32 scan_window = 256;
+
+ZORDER_TARGET_SSE2 static const u32 *scan_range_sse2(const u32 *keys, const u32 *end, u32 last, const CellRect &cells,
+                                                    const u32 *ids, vector<u32> &result) {
+    __m128i mask = _mm_set1_epi32(0x55555555);
+    __m128i sign = _mm_set1_epi32((i32)0x80000000);
+    __m128i xmin = _mm_set1_epi32((i32)intersperse_zeroes(cells.xmin) - 1);
+    __m128i ymin = _mm_set1_epi32((i32)intersperse_zeroes(cells.ymin) - 1);
+    __m128i xmax = _mm_set1_epi32((i32)intersperse_zeroes(cells.xmax) + 1);
+    __m128i ymax = _mm_set1_epi32((i32)intersperse_zeroes(cells.ymax) + 1);
+    __m128i limit = _mm_set1_epi32((i32)(last ^ 0x80000000));
+    size_t count = result.size();
+    const u32 *it = keys;
+    while (end - it >= 4) {
+        const u32 *window_end = it + min(end - it, (ptrdiff_t)scan_window) / 4 * 4;
+        result.resize(count + (window_end - it));
+        u32 *out = result.data();
+        for (; it != window_end; it += 4) {
+            __m128i z = _mm_loadu_si128((const __m128i *)it);
+            __m128i past = _mm_cmpgt_epi32(_mm_xor_si128(z, sign), limit);
+            __m128i x = _mm_and_si128(z, mask);
+            __m128i y = _mm_and_si128(_mm_srli_epi32(z, 1), mask);
+            __m128i inside = _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi32(x, xmin), _mm_cmpgt_epi32(xmax, x)),
+                                           _mm_and_si128(_mm_cmpgt_epi32(y, ymin), _mm_cmpgt_epi32(ymax, y)));
+            u32 hits = _mm_movemask_ps(_mm_castsi128_ps(_mm_andnot_si128(past, inside)));
+            // sse2 has no variable permute, so the ids are moved one by one,
+            // but without a branch on each of them
+            const u32 *group = ids + (it - keys);
+            u64 order = compress_table.indices[hits];
+            out[count] = group[order & 0xff];
+            out[count + 1] = group[(order >> 8) & 0xff];
+            out[count + 2] = group[(order >> 16) & 0xff];
+            out[count + 3] = group[(order >> 24) & 0xff];
+            count += compress_table.counts[hits];
+            // the keys are sorted, so the first key past last ends the range
+            u32 stop = _mm_movemask_ps(_mm_castsi128_ps(past));
+            if (stop) {
+                result.resize(count);
+                return it + highest_bit_position(stop & (0 - stop));
+            }
+        }
+    }
+    result.resize(count);
+    return scan_range_portable(it, end, last, cells, ids + (it - keys), result);
+}
+
+ZORDER_TARGET_AVX2 static const u32 *scan_range_avx2(const u32 *keys, const u32 *end, u32 last, const CellRect &cells,
+                                                    const u32 *ids, vector<u32> &result) {
+    __m256i mask = _mm256_set1_epi32(0x55555555);
+    __m256i sign = _mm256_set1_epi32((i32)0x80000000);
+    __m256i xmin = _mm256_set1_epi32((i32)intersperse_zeroes(cells.xmin) - 1);
+    __m256i ymin = _mm256_set1_epi32((i32)intersperse_zeroes(cells.ymin) - 1);
+    __m256i xmax = _mm256_set1_epi32((i32)intersperse_zeroes(cells.xmax) + 1);
+    __m256i ymax = _mm256_set1_epi32((i32)intersperse_zeroes(cells.ymax) + 1);
+    __m256i limit = _mm256_set1_epi32((i32)(last ^ 0x80000000));
+    size_t count = result.size();
+    const u32 *it = keys;
+    while (end - it >= 8) {
+        const u32 *window_end = it + min(end - it, (ptrdiff_t)scan_window) / 8 * 8;
+        result.resize(count + (window_end - it));
+        u32 *out = result.data();
+        for (; it != window_end; it += 8) {
+            __m256i z = _mm256_loadu_si256((const __m256i *)it);
+            __m256i past = _mm256_cmpgt_epi32(_mm256_xor_si256(z, sign), limit);
+            __m256i x = _mm256_and_si256(z, mask);
+            __m256i y = _mm256_and_si256(_mm256_srli_epi32(z, 1), mask);
+            __m256i inside = _mm256_and_si256(_mm256_and_si256(_mm256_cmpgt_epi32(x, xmin), _mm256_cmpgt_epi32(xmax, x)),
+                                              _mm256_and_si256(_mm256_cmpgt_epi32(y, ymin), _mm256_cmpgt_epi32(ymax, y)));
+            u32 hits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_andnot_si256(past, inside)));
+            __m256i id = _mm256_loadu_si256((const __m256i *)(ids + (it - keys)));
+            __m256i order = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&compress_table.indices[hits]));
+            _mm256_storeu_si256((__m256i *)(out + count), _mm256_permutevar8x32_epi32(id, order));
+            count += compress_table.counts[hits];
+            // the keys are sorted, so the first key past last ends the range
+            u32 stop = _mm256_movemask_ps(_mm256_castsi256_ps(past));
+            if (stop) {
+                result.resize(count);
+                return it + highest_bit_position(stop & (0 - stop));
+            }
+        }
+    }
+    result.resize(count);
+    return scan_range_portable(it, end, last, cells, ids + (it - keys), result);
+}
+
+// the x bits of keys, masked in place, packed into the low bits
+ZORDER_TARGET_SSE2 static inline __m128i compact_bits_sse2(__m128i x) {
+    x = _mm_and_si128(_mm_or_si128(x, _mm_srli_epi32(x, 1)), _mm_set1_epi32(0x33333333));
+    x = _mm_and_si128(_mm_or_si128(x, _mm_srli_epi32(x, 2)), _mm_set1_epi32(0x0f0f0f0f));
+    x = _mm_and_si128(_mm_or_si128(x, _mm_srli_epi32(x, 4)), _mm_set1_epi32(0x00ff00ff));
+    x = _mm_and_si128(_mm_or_si128(x, _mm_srli_epi32(x, 8)), _mm_set1_epi32(0x0000ffff));
+    return x;
+}
+
+// the gaps from the centre c to the nearest and furthest points of the cells
+// v along one axis, like in CircleShape::classify_cell, cut off at 32767.
+// no_inside is set for the cells that can't be inside: border cells, and
+// those with the furthest gap cut off
+ZORDER_TARGET_SSE2 static inline void circle_gaps_sse2(__m128i v, i32 c, __m128i &near, __m128i &far,
+                                                      __m128i &no_inside) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i two = _mm_set1_epi32(2);
+    __m128i cut = _mm_set1_epi32(32767);
+    __m128i border = _mm_set1_epi32(0xffff);
+    __m128i d = _mm_sub_epi32(v, _mm_set1_epi32(c));
+    __m128i below = _mm_srai_epi32(d, 31);
+    __m128i gap = _mm_sub_epi32(_mm_xor_si128(d, below), below);
+    __m128i at_min = _mm_cmpeq_epi32(v, zero);
+    __m128i at_max = _mm_cmpeq_epi32(v, border);
+    __m128i open = _mm_or_si128(_mm_and_si128(at_min, _mm_cmpgt_epi32(d, zero)), _mm_and_si128(at_max, below));
+    near = _mm_andnot_si128(open, _mm_and_si128(_mm_sub_epi32(gap, two), _mm_cmpgt_epi32(gap, two)));
+    far = _mm_add_epi32(gap, two);
+    __m128i near_cut = _mm_cmpgt_epi32(near, cut);
+    __m128i far_cut = _mm_cmpgt_epi32(far, cut);
+    near = _mm_or_si128(_mm_andnot_si128(near_cut, near), _mm_and_si128(near_cut, cut));
+    far = _mm_or_si128(_mm_andnot_si128(far_cut, far), _mm_and_si128(far_cut, cut));
+    no_inside = _mm_or_si128(_mm_or_si128(at_min, at_max), far_cut);
+}
+
+// the keys of a group in cells inside and outside circle, as bit masks. the
+// gaps are scaled with the high half of a 16 bit multiply, and the x and y
+// ones summed up squared with a single multiply-add
+ZORDER_TARGET_SSE2 static inline void classify_circle_sse2(__m128i x, __m128i y, const CircleShape &circle,
+                                                          u32 &inside, u32 &outside) {
+    __m128i near_x, far_x, no_inside_x;
+    __m128i near_y, far_y, no_inside_y;
+    circle_gaps_sse2(compact_bits_sse2(x), circle.lane_cx, near_x, far_x, no_inside_x);
+    circle_gaps_sse2(compact_bits_sse2(y), circle.lane_cy, near_y, far_y, no_inside_y);
+    __m128i one = _mm_set1_epi32(1);
+    __m128i near = _mm_or_si128(_mm_mulhi_epu16(near_x, _mm_set1_epi32(circle.lane_wx_lo)),
+                                _mm_slli_epi32(_mm_mulhi_epu16(near_y, _mm_set1_epi32(circle.lane_wy_lo)), 16));
+    __m128i far = _mm_or_si128(_mm_add_epi32(_mm_mulhi_epu16(far_x, _mm_set1_epi32(circle.lane_wx_hi)), one),
+                               _mm_slli_epi32(_mm_add_epi32(_mm_mulhi_epu16(far_y, _mm_set1_epi32(circle.lane_wy_hi)),
+                                                            one), 16));
+    __m128i near_sq = _mm_madd_epi16(near, near);
+    __m128i far_sq = _mm_madd_epi16(far, far);
+    __m128i no_inside = _mm_or_si128(_mm_or_si128(no_inside_x, no_inside_y),
+                                     _mm_cmpgt_epi32(far_sq, _mm_set1_epi32(circle.lane_inside_sq)));
+    outside = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(near_sq, _mm_set1_epi32(circle.lane_outside_sq))));
+    inside = ~_mm_movemask_ps(_mm_castsi128_ps(no_inside)) & 0xf;
+}
+
+ZORDER_TARGET_SSE2 static const u32 *scan_range_split_sse2(const u32 *keys, const u32 *end, u32 last,
+                                                          const CellRect &cells, const CellRect &inner,
+                                                          const CircleShape &circle, const u32 *ids,
+                                                          SplitOutput &out) {
+    __m128i mask = _mm_set1_epi32(0x55555555);
+    __m128i sign = _mm_set1_epi32((i32)0x80000000);
+    __m128i xmin = _mm_set1_epi32((i32)intersperse_zeroes(cells.xmin) - 1);
+    __m128i ymin = _mm_set1_epi32((i32)intersperse_zeroes(cells.ymin) - 1);
+    __m128i xmax = _mm_set1_epi32((i32)intersperse_zeroes(cells.xmax) + 1);
+    __m128i ymax = _mm_set1_epi32((i32)intersperse_zeroes(cells.ymax) + 1);
+    __m128i inner_xmin = _mm_set1_epi32((i32)intersperse_zeroes(inner.xmin) - 1);
+    __m128i inner_ymin = _mm_set1_epi32((i32)intersperse_zeroes(inner.ymin) - 1);
+    __m128i inner_xmax = _mm_set1_epi32((i32)intersperse_zeroes(inner.xmax) + 1);
+    __m128i inner_ymax = _mm_set1_epi32((i32)intersperse_zeroes(inner.ymax) + 1);
+    __m128i limit = _mm_set1_epi32((i32)(last ^ 0x80000000));
+    size_t inside_count = out.inside_count;
+    size_t edge_count = out.edge_count;
+    const u32 *it = keys;
+    while (end - it >= 4) {
+        const u32 *window_end = it + min(end - it, (ptrdiff_t)scan_window) / 4 * 4;
+        u32 *inside_out = grow_output(*out.inside, inside_count, window_end - it);
+        u32 *edge_out = grow_output(*out.edge, edge_count, window_end - it);
+        for (; it != window_end; it += 4) {
+            __m128i z = _mm_loadu_si128((const __m128i *)it);
+            __m128i past = _mm_cmpgt_epi32(_mm_xor_si128(z, sign), limit);
+            __m128i x = _mm_and_si128(z, mask);
+            __m128i y = _mm_and_si128(_mm_srli_epi32(z, 1), mask);
+            __m128i in_rect = _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi32(x, xmin), _mm_cmpgt_epi32(xmax, x)),
+                                            _mm_and_si128(_mm_cmpgt_epi32(y, ymin), _mm_cmpgt_epi32(ymax, y)));
+            __m128i in_square = _mm_and_si128(
+                _mm_and_si128(_mm_cmpgt_epi32(x, inner_xmin), _mm_cmpgt_epi32(inner_xmax, x)),
+                _mm_and_si128(_mm_cmpgt_epi32(y, inner_ymin), _mm_cmpgt_epi32(inner_ymax, y)));
+            u32 hits = _mm_movemask_ps(_mm_castsi128_ps(_mm_andnot_si128(past, in_rect)));
+            u32 inside_hits = hits & _mm_movemask_ps(_mm_castsi128_ps(in_square));
+            u32 edge_hits = hits & ~inside_hits;
+            // only the keys outside the square need the circle
+            if (edge_hits) {
+                u32 in_circle, out_circle;
+                classify_circle_sse2(x, y, circle, in_circle, out_circle);
+                inside_hits |= edge_hits & in_circle;
+                edge_hits &= ~(in_circle | out_circle);
+            }
+            const u32 *group = ids + (it - keys);
+            u64 order = compress_table.indices[inside_hits];
+            inside_out[inside_count] = group[order & 0xff];
+            inside_out[inside_count + 1] = group[(order >> 8) & 0xff];
+            inside_out[inside_count + 2] = group[(order >> 16) & 0xff];
+            inside_out[inside_count + 3] = group[(order >> 24) & 0xff];
+            inside_count += compress_table.counts[inside_hits];
+            order = compress_table.indices[edge_hits];
+            edge_out[edge_count] = group[order & 0xff];
+            edge_out[edge_count + 1] = group[(order >> 8) & 0xff];
+            edge_out[edge_count + 2] = group[(order >> 16) & 0xff];
+            edge_out[edge_count + 3] = group[(order >> 24) & 0xff];
+            edge_count += compress_table.counts[edge_hits];
+            u32 stop = _mm_movemask_ps(_mm_castsi128_ps(past));
+            if (stop) {
+                out.inside_count = inside_count;
+                out.edge_count = edge_count;
+                return it + highest_bit_position(stop & (0 - stop));
+            }
+        }
+    }
+    out.inside_count = inside_count;
+    out.edge_count = edge_count;
+    return scan_range_split_portable(it, end, last, cells, inner, circle, ids + (it - keys), out);
+}
+
+ZORDER_TARGET_AVX2 static inline __m256i compact_bits_avx2(__m256i x) {
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_srli_epi32(x, 1)), _mm256_set1_epi32(0x33333333));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_srli_epi32(x, 2)), _mm256_set1_epi32(0x0f0f0f0f));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_srli_epi32(x, 4)), _mm256_set1_epi32(0x00ff00ff));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_srli_epi32(x, 8)), _mm256_set1_epi32(0x0000ffff));
+    return x;
+}
+
+ZORDER_TARGET_AVX2 static inline void circle_gaps_avx2(__m256i v, i32 c, __m256i &near, __m256i &far,
+                                                      __m256i &no_inside) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i two = _mm256_set1_epi32(2);
+    __m256i cut = _mm256_set1_epi32(32767);
+    __m256i border = _mm256_set1_epi32(0xffff);
+    __m256i d = _mm256_sub_epi32(v, _mm256_set1_epi32(c));
+    __m256i gap = _mm256_abs_epi32(d);
+    __m256i at_min = _mm256_cmpeq_epi32(v, zero);
+    __m256i at_max = _mm256_cmpeq_epi32(v, border);
+    __m256i open = _mm256_or_si256(_mm256_and_si256(at_min, _mm256_cmpgt_epi32(d, zero)),
+                                   _mm256_and_si256(at_max, _mm256_cmpgt_epi32(zero, d)));
+    near = _mm256_andnot_si256(open, _mm256_max_epi32(_mm256_sub_epi32(gap, two), zero));
+    far = _mm256_add_epi32(gap, two);
+    no_inside = _mm256_or_si256(_mm256_or_si256(at_min, at_max), _mm256_cmpgt_epi32(far, cut));
+    near = _mm256_min_epi32(near, cut);
+    far = _mm256_min_epi32(far, cut);
+}
+
+ZORDER_TARGET_AVX2 static inline void classify_circle_avx2(__m256i x, __m256i y, const CircleShape &circle,
+                                                          u32 &inside, u32 &outside) {
+    __m256i near_x, far_x, no_inside_x;
+    __m256i near_y, far_y, no_inside_y;
+    circle_gaps_avx2(compact_bits_avx2(x), circle.lane_cx, near_x, far_x, no_inside_x);
+    circle_gaps_avx2(compact_bits_avx2(y), circle.lane_cy, near_y, far_y, no_inside_y);
+    __m256i one = _mm256_set1_epi32(1);
+    __m256i near = _mm256_or_si256(
+        _mm256_mulhi_epu16(near_x, _mm256_set1_epi32(circle.lane_wx_lo)),
+        _mm256_slli_epi32(_mm256_mulhi_epu16(near_y, _mm256_set1_epi32(circle.lane_wy_lo)), 16));
+    __m256i far = _mm256_or_si256(
+        _mm256_add_epi32(_mm256_mulhi_epu16(far_x, _mm256_set1_epi32(circle.lane_wx_hi)), one),
+        _mm256_slli_epi32(_mm256_add_epi32(_mm256_mulhi_epu16(far_y, _mm256_set1_epi32(circle.lane_wy_hi)), one), 16));
+    __m256i near_sq = _mm256_madd_epi16(near, near);
+    __m256i far_sq = _mm256_madd_epi16(far, far);
+    __m256i no_inside = _mm256_or_si256(_mm256_or_si256(no_inside_x, no_inside_y),
+                                        _mm256_cmpgt_epi32(far_sq, _mm256_set1_epi32(circle.lane_inside_sq)));
+    outside = _mm256_movemask_ps(_mm256_castsi256_ps(
+        _mm256_cmpgt_epi32(near_sq, _mm256_set1_epi32(circle.lane_outside_sq))));
+    inside = ~_mm256_movemask_ps(_mm256_castsi256_ps(no_inside)) & 0xff;
+}
+
+ZORDER_TARGET_AVX2 static const u32 *scan_range_split_avx2(const u32 *keys, const u32 *end, u32 last,
+                                                          const CellRect &cells, const CellRect &inner,
+                                                          const CircleShape &circle, const u32 *ids,
+                                                          SplitOutput &out) {
+    __m256i mask = _mm256_set1_epi32(0x55555555);
+    __m256i sign = _mm256_set1_epi32((i32)0x80000000);
+    __m256i xmin = _mm256_set1_epi32((i32)intersperse_zeroes(cells.xmin) - 1);
+    __m256i ymin = _mm256_set1_epi32((i32)intersperse_zeroes(cells.ymin) - 1);
+    __m256i xmax = _mm256_set1_epi32((i32)intersperse_zeroes(cells.xmax) + 1);
+    __m256i ymax = _mm256_set1_epi32((i32)intersperse_zeroes(cells.ymax) + 1);
+    __m256i inner_xmin = _mm256_set1_epi32((i32)intersperse_zeroes(inner.xmin) - 1);
+    __m256i inner_ymin = _mm256_set1_epi32((i32)intersperse_zeroes(inner.ymin) - 1);
+    __m256i inner_xmax = _mm256_set1_epi32((i32)intersperse_zeroes(inner.xmax) + 1);
+    __m256i inner_ymax = _mm256_set1_epi32((i32)intersperse_zeroes(inner.ymax) + 1);
+    __m256i limit = _mm256_set1_epi32((i32)(last ^ 0x80000000));
+    size_t inside_count = out.inside_count;
+    size_t edge_count = out.edge_count;
+    const u32 *it = keys;
+    while (end - it >= 8) {
+        const u32 *window_end = it + min(end - it, (ptrdiff_t)scan_window) / 8 * 8;
+        u32 *inside_out = grow_output(*out.inside, inside_count, window_end - it);
+        u32 *edge_out = grow_output(*out.edge, edge_count, window_end - it);
+        for (; it != window_end; it += 8) {
+            __m256i z = _mm256_loadu_si256((const __m256i *)it);
+            __m256i past = _mm256_cmpgt_epi32(_mm256_xor_si256(z, sign), limit);
+            __m256i x = _mm256_and_si256(z, mask);
+            __m256i y = _mm256_and_si256(_mm256_srli_epi32(z, 1), mask);
+            __m256i in_rect = _mm256_and_si256(_mm256_and_si256(_mm256_cmpgt_epi32(x, xmin), _mm256_cmpgt_epi32(xmax, x)),
+                                               _mm256_and_si256(_mm256_cmpgt_epi32(y, ymin), _mm256_cmpgt_epi32(ymax, y)));
+            __m256i in_square = _mm256_and_si256(
+                _mm256_and_si256(_mm256_cmpgt_epi32(x, inner_xmin), _mm256_cmpgt_epi32(inner_xmax, x)),
+                _mm256_and_si256(_mm256_cmpgt_epi32(y, inner_ymin), _mm256_cmpgt_epi32(inner_ymax, y)));
+            u32 hits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_andnot_si256(past, in_rect)));
+            u32 inside_hits = hits & _mm256_movemask_ps(_mm256_castsi256_ps(in_square));
+            u32 edge_hits = hits & ~inside_hits;
+            if (edge_hits) {
+                u32 in_circle, out_circle;
+                classify_circle_avx2(x, y, circle, in_circle, out_circle);
+                inside_hits |= edge_hits & in_circle;
+                edge_hits &= ~(in_circle | out_circle);
+            }
+            __m256i id = _mm256_loadu_si256((const __m256i *)(ids + (it - keys)));
+            __m256i order = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&compress_table.indices[inside_hits]));
+            _mm256_storeu_si256((__m256i *)(inside_out + inside_count), _mm256_permutevar8x32_epi32(id, order));
+            inside_count += compress_table.counts[inside_hits];
+            order = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&compress_table.indices[edge_hits]));
+            _mm256_storeu_si256((__m256i *)(edge_out + edge_count), _mm256_permutevar8x32_epi32(id, order));
+            edge_count += compress_table.counts[edge_hits];
+            u32 stop = _mm256_movemask_ps(_mm256_castsi256_ps(past));
+            if (stop) {
+                out.inside_count = inside_count;
+                out.edge_count = edge_count;
+                return it + highest_bit_position(stop & (0 - stop));
+            }
+        }
+    }
+    out.inside_count = inside_count;
+    out.edge_count = edge_count;
+    return scan_range_split_portable(it, end, last, cells, inner, circle, ids + (it - keys), out);
+}
+
+#endif
+
+
+// the scan of one z-range in area lookups
+inline const u32 *scan_range(const u32 *keys, const u32 *end, u32 last, const CellRect &cells,
+                             const u32 *ids, vector<u32> &result) {
+#ifdef ZORDER_X86
+    if (use_avx2)
+        return scan_range_avx2(keys, end, last, cells, ids, result);
+    if (use_sse2)
+        return scan_range_sse2(keys, end, last, cells, ids, result);
+#endif
+    return scan_range_portable(keys, end, last, cells, ids, result);
+}
+
+inline const u64 *scan_range(const u64 *keys, const u64 *end, u64 last, const CellRect &cells,
+                             const u32 *ids, vector<u32> &result) {
+    return scan_range_portable(keys, end, last, cells, ids, result);
+}
+
+// the scan of one z-range in radius lookups, which splits the keys in cells
+// by how they lie to the circle
+inline const u32 *scan_range_split(const u32 *keys, const u32 *end, u32 last, const CellRect &cells,
+                                   const CellRect &inner, const CircleShape &circle, const u32 *ids,
+                                   SplitOutput &out) {
+#ifdef ZORDER_X86
+    if (use_avx2)
+        return scan_range_split_avx2(keys, end, last, cells, inner, circle, ids, out);
+    if (use_sse2)
+        return scan_range_split_sse2(keys, end, last, cells, inner, circle, ids, out);
+#endif
+    return scan_range_split_portable(keys, end, last, cells, inner, circle, ids, out);
+}
+
+inline const u64 *scan_range_split(const u64 *keys, const u64 *end, u64 last, const CellRect &cells,
+                                   const CellRect &inner, const CircleShape &circle, const u32 *ids,
+                                   SplitOutput &out) {
+    return scan_range_split_portable(keys, end, last, cells, inner, circle, ids, out);
+}
+
+
+// blocks of 128 values packed with the same number of bits each. value j goes
+// to lane j % 4, and each lane is a stream of 32 values, bits words long. the
+// streams are interleaved word by word, so that one 128 bit load holds the
+// same word of every lane, and four values come out of each shift and mask
+
+inline u32 packed_words(u32 bits) {
+    return 4 * bits;
+}
+
+inline void pack_block(const u32 *values, u32 bits, u32 *out) {
+    if (bits == 0)
+        return;
+    memset(out, 0, packed_words(bits) * sizeof(u32));
+    for (u32 j = 0; j < 128; ++j) {
+        u32 bit = (j >> 2) * bits;
+        u32 shift = bit & 31;
+        u32 *w = out + 4 * (bit >> 5) + (j & 3);
+        w[0] |= values[j] << shift;
+        if (shift + bits > 32)
+            w[4] |= values[j] >> (32 - shift);
+    }
+}
+
+static void unpack_block_portable(const u32 *in, u32 bits, u32 *values) {
+    if (bits == 0) {
+        memset(values, 0, 128 * sizeof(u32));
+        return;
+    }
+    u32 mask = bits == 32 ? ~0u : (1u << bits) - 1;
+    for (u32 j = 0; j < 128; ++j) {
+        u32 bit = (j >> 2) * bits;
+        u32 shift = bit & 31;
+        const u32 *w = in + 4 * (bit >> 5) + (j & 3);
+        u32 v = w[0] >> shift;
+        if (shift + bits > 32)
+            v |= w[4] << (32 - shift);
+        values[j] = v & mask;
+    }
+}
+
+#ifdef ZORDER_X86
+
+ZORDER_TARGET_SSE2 static void unpack_block_sse2(const u32 *in, u32 bits, u32 *values) {
+    if (bits == 0) {
+        memset(values, 0, 128 * sizeof(u32));
+        return;
+    }
+    __m128i mask = _mm_set1_epi32(bits == 32 ? -1 : (i32)((1u << bits) - 1));
+    for (u32 k = 0; k < 32; ++k) {
+        u32 bit = k * bits;
+        u32 shift = bit & 31;
+        const __m128i *w = (const __m128i *)(in + 4 * (bit >> 5));
+        __m128i v = _mm_srl_epi32(_mm_loadu_si128(w), _mm_cvtsi32_si128(shift));
+        if (shift + bits > 32)
+            v = _mm_or_si128(v, _mm_sll_epi32(_mm_loadu_si128(w + 1), _mm_cvtsi32_si128(32 - shift)));
+        _mm_storeu_si128((__m128i *)(values + 4 * k), _mm_and_si128(v, mask));
+    }
+}
+
+// unpack deltas and add them up from base in the same pass. four consecutive
+// values share a vector, so the running sum is two shifted adds and a carry
+ZORDER_TARGET_SSE2 static void decode_block_sse2(const u32 *in, u32 bits, u32 base, u32 *keys) {
+    unpack_block_sse2(in, bits, keys);
+    __m128i carry = _mm_set1_epi32((i32)base);
+    for (u32 k = 0; k < 32; ++k) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(keys + 4 * k));
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+        v = _mm_add_epi32(v, carry);
+        _mm_storeu_si128((__m128i *)(keys + 4 * k), v);
+        carry = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+}
+
+#endif
+
+inline void unpack_block(const u32 *in, u32 bits, u32 *values) {
+#ifdef ZORDER_X86
+    if (use_sse2)
+        return unpack_block_sse2(in, bits, values);
+#endif
+    unpack_block_portable(in, bits, values);
+}
+
+// the keys of a block from its first key and the packed deltas between them
+inline void decode_block(const u32 *in, u32 bits, u32 base, u32 *keys, u32 *) {
+#ifdef ZORDER_X86
+    if (use_sse2)
+        return decode_block_sse2(in, bits, base, keys);
+#endif
+    unpack_block_portable(in, bits, keys);
+    u32 key = base;
+    for (u32 j = 0; j < 128; ++j)
+        keys[j] = key += keys[j];
+}
+
+inline void decode_block(const u32 *in, u32 bits, u64 base, u64 *keys, u32 *deltas) {
+    unpack_block(in, bits, deltas);
+    u64 key = base;
+    for (u32 j = 0; j < 128; ++j)
+        keys[j] = key += deltas[j];
+}
+
+// a query rectangle for area_lookup_batch, with corners in any order
+struct AreaQuery {
+    v2 p0, p1;
+};
+
+
+// counters collected by an index instantiated with CollectStats set
+struct QueryStats {
+    u64 queries;
+    u64 ranges;          // z-ranges generated by partition_range
+    u64 keys_scanned;    // keys that fell inside one of the z-ranges
+    u64 false_positives; // scanned keys outside the query rectangle
+    u64 results;
+};
+
+
+// everything a lookup writes to. the lookups on an index are const, so any
+// number of threads can query the same index at once as long as each of them
+// brings its own scratch. the buffers are kept between lookups, so a scratch
+// that is reused stops allocating once it has grown
+template<class Key>
+struct QueryScratch {
+    // the z-ranges of the last lookup
+    static const u32 max_ranges = 256;
+    pair<Key,Key> ranges[max_ranges];
+    u32 range_count;
+    // only updated by an index with CollectStats set
+    QueryStats stats;
+    // radius_lookup: the ids that need the exact test
+    vector<u32> radius_candidates;
+    // area_lookup_batch
+    vector<CellRect> batch_cells;
+    vector<pair<Key,Key>> batch_ranges;
+    vector<u32> batch_range_offsets;
+    vector<u32> batch_range_query;
+    vector<Key> batch_starts;
+    vector<u32> batch_order;
+    vector<Key> batch_start_scratch;
+    vector<u32> batch_order_scratch;
+    vector<u32> batch_hits;
+    // the query and the number of hits of each range, in sweep order
+    vector<pair<u32,u32>> batch_spans;
+    vector<u32> batch_cursors;
+    // knn: max-heap of (squared distance, id) for the k best candidates
+    vector<pair<f32,u32>> knn_heap;
+    // lookups in a frozen index: one block of keys, and its deltas
+    static const u32 frozen_block_size = 128;
+    Key block_keys[frozen_block_size];
+    u32 block_deltas[frozen_block_size];
+
+    QueryScratch() {
+        range_count = 0;
+        stats = QueryStats();
+    }
+};
+
+
+// state for parallel_area_lookup: a scratch and a buffer of hits for each
+// worker, and where the hits of each query were put
+template<class Key>
+struct ParallelQueryScratch {
+    struct Span {
+        u32 worker;
+        u32 begin, end;
+    };
+    vector<QueryScratch<Key>> workers;
+    vector<vector<u32>> hits;
+    vector<vector<u32>> results;
+    vector<Span> spans;
+};
+
+
+// with CollectStats unset the counting compiles away entirely
+template<class Key, bool CollectStats = false>
+struct BasicZOrderIndex {
+    typedef Morton<Key> M;
+
+    v2 minpos;
+    v2 maxpos;
+    v2 size;
+    typename M::Scale scale;
+    // when set, minpos/maxpos were given by the caller and are kept across
+    // builds. points outside them are clamped to the edge cells
+    bool fixed_bounds;
+    // sorted keys, with the caller's id for each key at the same position in
+    // ids. the keys are kept on their own so the scans touch nothing else
+    vector<Key> zvalues;
+    vector<u32> ids;
+    vector<Key> zvalue_scratch;
+    vector<u32> id_scratch;
+    // at most range_budget z-ranges are generated per lookup, which trades
+    // scanning more keys for fewer binary searches
+    static const u32 max_range_budget = QueryScratch<Key>::max_ranges;
+    u32 range_budget;
+    // used by the lookups that aren't given a scratch of their own
+    QueryScratch<Key> default_scratch;
+    ParallelQueryScratch<Key> default_parallel_scratch;
+
+    // every summary_stride-th key, so that a search for a key far away only
+    // touches this small array and then a single block of zvalues. rebuilt
+    // along with zvalues unless use_summary is unset
+    static const u32 summary_stride = 64;
+    vector<Key> summary;
+    bool use_summary;
+    // optionally, all keys in eytzinger (breadth first) order, 1-based, with
+    // the position in zvalues of each. the top levels of the tree share a few
+    // cache lines, and a search can prefetch the nodes it will need next.
+    // takes precedence over the summary when set, which is then not built
+    vector<Key> eytzinger;
+    vector<u32> eytzinger_rank;
+    bool use_eytzinger;
+    // the position in zvalues of the first key of each prefix of the top
+    // prefix_bits key bits (up to the highest bit in use), and one past the
+    // end. a search only has to look at the keys of one prefix. prefix_bits is
+    // picked from the number of keys, for a handful of keys per prefix. takes
+    // precedence over the eytzinger layout and the summary when set, which are
+    // then not built
+    vector<u32> prefix_offsets;
+    u32 prefix_bits;
+    u32 prefix_shift;
+    bool use_prefix_table;
+    // one bit per block of keys sharing their top occupancy_bits bits (up to
+    // the highest bit in use), set if any point is in the block. queries leave
+    // out the parts of their rectangle over empty blocks while partitioning
+    // it, so those cost neither ranges nor searches. 0 turns it off
+    u32 occupancy_bits;
+    u32 occupancy_shift;
+    BitVector occupancy;
+    bool has_occupancy;
+    // the largest key when the bitmap was built. no block past it is occupied
+    Key occupancy_limit;
+
+    // fraction of the point bounds to add as headroom on each side when
+    // building, so that points may move a little before commit() has to rebuild
+    f32 bounds_slack;
+    // last known position of each point, indexed by id
+    vector<v2> id_positions;
+    // the parallel build() falls back to the serial one below this many points
+    u32 parallel_build_threshold;
+    // state for the parallel build()
+    vector<pair<v2,v2>> chunk_bounds;
+    vector<u32> chunk_id_limits;
+    vector<u32> radix_histograms;
+    // state for update()/commit()
+    vector<pair<u32,v2>> pending_updates;
+    vector<u32> removed_slots;
+    vector<pair<Key,u32>> inserted;
+    vector<v2> rebuild_points;
+
+    BasicZOrderIndex() {
+        bounds_slack = 0;
+        range_budget = 64;
+        parallel_build_threshold = 1 << 16;
+        use_summary = true;
+        use_eytzinger = false;
+        use_prefix_table = true;
+        prefix_bits = 0;
+        prefix_shift = 0;
+        occupancy_bits = 16;
+        occupancy_shift = 0;
+        has_occupancy = false;
+        occupancy_limit = 0;
+        reset_stats();
+        reset();
+    }
+
+    void reset_stats() {
+        default_scratch.stats = QueryStats();
+    }
+
+    void reset() {
+        minpos = v2{0,0};
+        maxpos = v2{0,0};
+        size = v2{0,0};
+        scale = typename M::Scale();
+        fixed_bounds = false;
+        zvalues.clear();
+        ids.clear();
+        summary.clear();
+        eytzinger.clear();
+        eytzinger_rank.clear();
+        prefix_offsets.clear();
+        occupancy.clear();
+        has_occupancy = false;
+        default_scratch.range_count = 0;
+        id_positions.clear();
+        pending_updates.clear();
+    }
+
+    // convert the real valued argument to a discrete representation
+    // in the lower M::axis_bits bits of the result
+    inline u32 discretize_x(f32 x) const {
+        return M::discretize(x, minpos.x, scale.x);
+    }
+    // likewise for y coord
+    inline u32 discretize_y(f32 y) const {
+        return M::discretize(y, minpos.y, scale.y);
+    }
+
+    inline v2 from_z(Key z) const {
+        typedef typename M::Real Real;
+        u32 x = M::deinterleave_x(z);
+        u32 y = M::deinterleave_y(z);
+        v2 p;
+        p.x = minpos.x + size.x * (f32)((Real)x / (Real)M::coord_max);
+        p.y = minpos.y + size.y * (f32)((Real)y / (Real)M::coord_max);
+        return p;
+    }
+
+    inline v2 clamp(v2 p) const {
+        if (p.x < minpos.x) p.x = minpos.x;
+        if (p.y < minpos.y) p.y = minpos.y;
+        if (p.x > maxpos.x) p.x = maxpos.x;
+        if (p.y > maxpos.y) p.y = maxpos.y;
+        return p;
+    }
+
+    inline bool is_size_valid() const {
+        return fabs(size.x) > 0.01f && fabs(size.y) > 0.01f;
+    }
+
+    // use the given world bounds for all following builds instead of the
+    // bounds of the points, which keeps keys stable from build to build and
+    // skips the bounds pass entirely
+    void set_fixed_bounds(v2 min, v2 max) {
+        fixed_bounds = true;
+        minpos = min;
+        maxpos = max;
+        size = max - min;
+        scale = M::discretize_scale(size);
+        assert(is_size_valid());
+    }
+
+    void clear_fixed_bounds() {
+        fixed_bounds = false;
+    }
+
+    // index the points, identifying each one by its position in points
+    void make_index(const vector<v2> &points) {
+        u32 count = (u32)points.size();
+        ids.resize(count);
+        for (u32 i = 0; i < count; ++i)
+            ids[i] = i;
+        build(points.data(), count);
+    }
+
+    // index the points, identifying each one by the corresponding entry in
+    // point_ids (such as an EntityId) in lookup results
+    void make_index(const vector<v2> &points, const vector<u32> &point_ids) {
+        assert(points.size() == point_ids.size());
+        ids = point_ids;
+        build(points.data(), (u32)points.size());
+    }
+
+    // index the points on the threads of pool. below parallel_build_threshold
+    // points, or with a single thread, this is the same as make_index
+    void make_index(WorkerPool &pool, const vector<v2> &points) {
+        u32 count = (u32)points.size();
+        ids.resize(count);
+        for (u32 i = 0; i < count; ++i)
+            ids[i] = i;
+        build(pool, points.data(), count);
+    }
+
+    void make_index(WorkerPool &pool, const vector<v2> &points, const vector<u32> &point_ids) {
+        assert(points.size() == point_ids.size());
+        ids = point_ids;
+        build(pool, points.data(), (u32)points.size());
+    }
+
+    // the bounds lo..hi of the points, grown by bounds_slack
+    void fit_bounds(v2 lo, v2 hi) {
+        v2 pad = (hi - lo) * bounds_slack;
+        minpos = lo - pad;
+        maxpos = hi + pad;
+        size = maxpos - minpos;
+        scale = M::discretize_scale(size);
+    }
+
+    // expects ids to be filled in already
+    void build(const v2 *points, u32 count) {
+        pending_updates.clear();
+        if (!fixed_bounds) {
+            v2 lo, hi;
+            compute_bounds(points, count, lo, hi);
+            fit_bounds(lo, hi);
+        }
+        if (!is_size_valid()) {
+            zvalues.clear();
+            ids.clear();
+            id_positions.clear();
+            build_search();
+            return;
+        }
+
+        u32 id_limit = 0;
+        for (u32 i = 0; i < count; ++i)
+            id_limit = max(id_limit, ids[i] + 1);
+        id_positions.resize(id_limit);
+        for (u32 i = 0; i < count; ++i)
+            id_positions[ids[i]] = points[i];
+
+        zvalues.resize(count);
+        M::encode_points(points, count, minpos, scale, zvalues.data());
+        radix_sort(zvalues, ids, zvalue_scratch, id_scratch);
+        build_search();
+    }
+
+    // rebuild the search structure and the occupancy bitmap from zvalues. seek
+    // only ever reads one of the prefix table, the eytzinger layout and the
+    // summary, in that order, so only the first of those that is set is built
+    void build_search() {
+        bool prefix_table = use_prefix_table && !zvalues.empty();
+        bool eytzinger_layout = use_eytzinger && !prefix_table && !zvalues.empty();
+
+        summary.clear();
+        if (use_summary && !prefix_table && !eytzinger_layout) {
+            for (u32 i = 0; i < zvalues.size(); i += summary_stride)
+                summary.push_back(zvalues[i]);
+        }
+
+        eytzinger.clear();
+        eytzinger_rank.clear();
+        if (eytzinger_layout) {
+            eytzinger.resize(zvalues.size() + 1);
+            eytzinger_rank.resize(zvalues.size() + 1);
+            u32 next = 0;
+            fill_eytzinger(1, next);
+            assert(next == zvalues.size());
+        }
+
+        // a counting sort pass: count the keys of each prefix, and turn the
+        // counts into the offsets of the prefixes
+        prefix_offsets.clear();
+        if (prefix_table) {
+            const u32 keys_per_prefix_log2 = 2;
+            const u32 max_prefix_bits = 24;
+            u32 key_bits = highest_bit_position(zvalues.back()) + 1;
+            u32 count_bits = highest_bit_position((u32)zvalues.size());
+            prefix_bits = count_bits > keys_per_prefix_log2 ? count_bits - keys_per_prefix_log2 : 1;
+            prefix_bits = min(prefix_bits, min(key_bits, max_prefix_bits));
+            prefix_shift = key_bits - prefix_bits;
+            prefix_offsets.assign(((size_t)1 << prefix_bits) + 1, 0);
+            for (u32 i = 0; i < zvalues.size(); ++i)
+                ++prefix_offsets[(u32)(zvalues[i] >> prefix_shift) + 1];
+            for (u32 i = 1; i < prefix_offsets.size(); ++i)
+                prefix_offsets[i] += prefix_offsets[i - 1];
+            assert(prefix_offsets.back() == zvalues.size());
+        }
+
+        occupancy.clear();
+        has_occupancy = occupancy_bits > 0 && !zvalues.empty();
+        if (has_occupancy) {
+            occupancy_limit = zvalues.back();
+            u32 key_bits = highest_bit_position(occupancy_limit) + 1;
+            occupancy_shift = key_bits > occupancy_bits ? key_bits - occupancy_bits : 0;
+            u32 last_block = ~0u;
+            for (u32 i = 0; i < zvalues.size(); ++i) {
+                u32 block = (u32)(zvalues[i] >> occupancy_shift);
+                if (block != last_block) {
+                    occupancy.set(block, true);
+                    last_block = block;
+                }
+            }
+        }
+    }
+
+    // false if no key in lo..hi can exist, going by the occupancy bitmap
+    inline bool may_be_occupied(Key lo, Key hi) const {
+        if (!has_occupancy)
+            return true;
+        if (lo > occupancy_limit)
+            return false;
+        if (hi > occupancy_limit)
+            hi = occupancy_limit;
+        return occupancy.any_set((u32)(lo >> occupancy_shift), (u32)(hi >> occupancy_shift));
+    }
+
+    // another shape, less the rectangles that only cover empty blocks. the
+    // keys of all cells of a rectangle lie between those of its corners
+    template<class Shape>
+    struct OccupiedShape {
+        const BasicZOrderIndex *index;
+        const Shape *shape;
+
+        ShapeOverlap classify(u32 xmin, u32 ymin, u32 xmax, u32 ymax) const {
+            if (index->has_occupancy &&
+                !index->may_be_occupied(M::interleave(xmin, ymin), M::interleave(xmax, ymax)))
+                return shape_outside;
+            return shape->classify(xmin, ymin, xmax, ymax);
+        }
+    };
+
+    template<class Shape>
+    OccupiedShape<Shape> occupied(const Shape &shape) const {
+        OccupiedShape<Shape> result = {this, &shape};
+        return result;
+    }
+
+    // an in-order walk of the tree hands out the sorted keys
+    void fill_eytzinger(u32 k, u32 &next) {
+        if (k >= eytzinger.size())
+            return;
+        fill_eytzinger(2 * k, next);
+        eytzinger[k] = zvalues[next];
+        eytzinger_rank[k] = next++;
+        fill_eytzinger(2 * k + 1, next);
+    }
+
+    // the position in zvalues of the first key not less than value
+    inline u32 eytzinger_lower_bound(Key value) const {
+        // the descendants this many levels down share a cache line
+        const u32 prefetch_span = 64 / sizeof(Key);
+        const Key *tree = eytzinger.data();
+        u32 n = (u32)eytzinger.size() - 1;
+        u32 k = 1;
+        while (k <= n) {
+            ZORDER_PREFETCH(tree + (u64)k * prefetch_span);
+            k = 2 * k + (tree[k] < value);
+        }
+        // the path ends with a right turn for every node less than value,
+        // after the left turn at the answer. drop them and that left turn
+        k >>= highest_bit_position(~k & (k + 1)) + 1;
+        return k == 0 ? (u32)zvalues.size() : eytzinger_rank[k];
+    }
+
+    // the first key at or after from that is not less than value. close to
+    // from it gallops, further away it searches the keys with the same prefix,
+    // goes through the eytzinger layout, or finds the block in the summary first
+    inline const Key *seek(const Key *from, Key value) const {
+        const Key *zbegin = zvalues.data();
+        const Key *zend = zbegin + zvalues.size();
+        if (zend - from <= summary_stride || from[summary_stride] >= value ||
+            (summary.empty() && eytzinger.empty() && prefix_offsets.empty()))
+            return gallop_lower_bound(from, zend, value);
+
+        // from[summary_stride] < value, so no key before from can be the
+        // answer, and it is past the summary entry of the block holding from
+        if (!prefix_offsets.empty()) {
+            Key prefix = value >> prefix_shift;
+            if (prefix >= prefix_offsets.size() - 1)
+                return zend;
+            return branchless_lower_bound(zbegin + prefix_offsets[(u32)prefix],
+                                          zbegin + prefix_offsets[(u32)prefix + 1], value);
+        }
+        if (!eytzinger.empty())
+            return zbegin + eytzinger_lower_bound(value);
+        u32 first_entry = (u32)(from - zbegin) / summary_stride + 1;
+        const Key *entry = branchless_lower_bound(summary.data() + first_entry, summary.data() + summary.size(), value);
+        u32 block = (u32)(entry - summary.data());
+        const Key *lo = zbegin + (block - 1) * summary_stride + 1;
+        const Key *hi = block < summary.size() ? zbegin + block * summary_stride : zend;
+        return branchless_lower_bound(lo, hi, value);
+    }
+
+    // build() in three parallel stages: the bounds and the largest id of each
+    // chunk of points, the keys and id_positions of each chunk, and the sort
+    void build(WorkerPool &pool, const v2 *points, u32 count) {
+        if (pool.size() == 1 || count < parallel_build_threshold) {
+            build(points, count);
+            return;
+        }
+        pending_updates.clear();
+
+        // a few chunks per thread, so that a slow thread can be helped out
+        u32 chunk_size = (count + pool.size() * 4 - 1) / (pool.size() * 4);
+        u32 chunk_count = (count + chunk_size - 1) / chunk_size;
+        chunk_bounds.resize(chunk_count);
+        chunk_id_limits.resize(chunk_count);
+        bool find_bounds = !fixed_bounds;
+        pool.parallel_for(count, chunk_size, [&](u32, u32 begin, u32 end) {
+            u32 chunk = begin / chunk_size;
+            if (find_bounds)
+                compute_bounds(points + begin, end - begin, chunk_bounds[chunk].first, chunk_bounds[chunk].second);
+            u32 id_limit = 0;
+            for (u32 i = begin; i < end; ++i)
+                id_limit = max(id_limit, ids[i] + 1);
+            chunk_id_limits[chunk] = id_limit;
+        });
+
+        if (find_bounds) {
+            v2 lo = chunk_bounds[0].first;
+            v2 hi = chunk_bounds[0].second;
+            for (u32 i = 1; i < chunk_count; ++i) {
+                lo.x = std::min(lo.x, chunk_bounds[i].first.x);
+                lo.y = std::min(lo.y, chunk_bounds[i].first.y);
+                hi.x = std::max(hi.x, chunk_bounds[i].second.x);
+                hi.y = std::max(hi.y, chunk_bounds[i].second.y);
+            }
+            fit_bounds(lo, hi);
+        }
+        if (!is_size_valid()) {
+            zvalues.clear();
+            ids.clear();
+            id_positions.clear();
+            build_search();
+            return;
+        }
+
+        u32 id_limit = 0;
+        for (u32 i = 0; i < chunk_count; ++i)
+            id_limit = max(id_limit, chunk_id_limits[i]);
+        id_positions.resize(id_limit);
+        zvalues.resize(count);
+        pool.parallel_for(count, chunk_size, [&](u32, u32 begin, u32 end) {
+            for (u32 i = begin; i < end; ++i)
+                id_positions[ids[i]] = points[i];
+            M::encode_points(points + begin, end - begin, minpos, scale, zvalues.data() + begin);
+        });
+
+        parallel_radix_sort(pool, zvalues, ids, zvalue_scratch, id_scratch, radix_histograms);
+        build_search();
+    }
+
+    // queue a new position for an already indexed point. takes effect on commit()
+    void update(u32 id, v2 new_pos) {
+        assert(id < id_positions.size());
+        pending_updates.push_back(make_pair(id, new_pos));
+    }
+
+    // apply the queued updates. points whose key changed are removed and merged
+    // back in at their new place, which is O(changed * log(n) + n). if a point
+    // has moved outside the indexed bounds the whole index is rebuilt instead,
+    // unless the bounds are fixed
+    void commit() {
+        if (pending_updates.empty())
+            return;
+
+        // only the last update of each point counts
+        std::stable_sort(pending_updates.begin(), pending_updates.end(),
+            [](const pair<u32,v2> &a, const pair<u32,v2> &b) { return a.first < b.first; });
+        u32 unique_count = 0;
+        for (u32 i = 0; i < pending_updates.size(); ++i) {
+            if (i + 1 < pending_updates.size() && pending_updates[i + 1].first == pending_updates[i].first)
+                continue;
+            pending_updates[unique_count++] = pending_updates[i];
+        }
+        pending_updates.resize(unique_count);
+
+        bool in_bounds = !zvalues.empty();
+        if (!fixed_bounds) {
+            for (auto &u : pending_updates) {
+                v2 p = u.second;
+                if (p.x < minpos.x || p.y < minpos.y || p.x > maxpos.x || p.y > maxpos.y)
+                    in_bounds = false;
+            }
+        }
+        if (!in_bounds) {
+            for (auto &u : pending_updates)
+                id_positions[u.first] = u.second;
+            rebuild_points.resize(ids.size());
+            for (u32 i = 0; i < ids.size(); ++i)
+                rebuild_points[i] = id_positions[ids[i]];
+            build(rebuild_points.data(), (u32)rebuild_points.size());
+            return;
+        }
+
+        removed_slots.clear();
+        inserted.clear();
+        for (auto &u : pending_updates) {
+            v2 old_pos = id_positions[u.first];
+            id_positions[u.first] = u.second;
+            Key old_z = M::interleave(discretize_x(old_pos.x), discretize_y(old_pos.y));
+            Key new_z = M::interleave(discretize_x(u.second.x), discretize_y(u.second.y));
+            if (old_z == new_z)
+                continue;
+
+            u32 slot = seek(zvalues.data(), old_z) - zvalues.data();
+            while (ids[slot] != u.first) {
+                ++slot;
+                assert(slot < zvalues.size() && zvalues[slot] == old_z);
+            }
+            removed_slots.push_back(slot);
+            inserted.push_back(make_pair(new_z, u.first));
+        }
+        pending_updates.clear();
+        if (inserted.empty())
+            return;
+
+        std::sort(removed_slots.begin(), removed_slots.end());
+        std::sort(inserted.begin(), inserted.end());
+        removed_slots.push_back(~0u); // sentinel
+
+        // merge the surviving entries with the re-keyed ones
+        u32 count = (u32)zvalues.size();
+        zvalue_scratch.resize(count);
+        id_scratch.resize(count);
+        u32 out = 0, next_removed = 0, next_inserted = 0;
+        for (u32 i = 0; i < count; ++i) {
+            if (i == removed_slots[next_removed]) {
+                ++next_removed;
+                continue;
+            }
+            Key z = zvalues[i];
+            for (; next_inserted < inserted.size() && inserted[next_inserted].first < z; ++out, ++next_inserted) {
+                zvalue_scratch[out] = inserted[next_inserted].first;
+                id_scratch[out] = inserted[next_inserted].second;
+            }
+            zvalue_scratch[out] = z;
+            id_scratch[out] = ids[i];
+            ++out;
+        }
+        for (; next_inserted < inserted.size(); ++out, ++next_inserted) {
+            zvalue_scratch[out] = inserted[next_inserted].first;
+            id_scratch[out] = inserted[next_inserted].second;
+        }
+        assert(out == count);
+        zvalues.swap(zvalue_scratch);
+        ids.swap(id_scratch);
+        build_search();
+    }
+
+    // the cells covered by the rectangle p0..p1, and the z-ranges (at most
+    // range_budget of them, none if the cells are known to be empty) to search
+    // for them. returns the number of ranges
+    u32 plan_area_query(v2 p0, v2 p1, CellRect &cells, pair<Key,Key> *out) const {
+        return plan_area_query(p0, p1, cells, out, RectShape(), 1);
+    }
+
+    // likewise, but the ranges only cover the parts of the rectangle that may
+    // be in shape, see partition_range
+    template<class Shape>
+    u32 plan_area_query(v2 p0, v2 p1, CellRect &cells, pair<Key,Key> *out, const Shape &shape,
+                        u32 min_split) const {
+        p0 = clamp(p0);
+        p1 = clamp(p1);
+        u32 xmin = discretize_x(p0.x);
+        u32 ymin = discretize_y(p0.y);
+        u32 xmax = discretize_x(p1.x);
+        u32 ymax = discretize_y(p1.y);
+        if (xmax < xmin) swap(xmin, xmax);
+        if (ymax < ymin) swap(ymin, ymax);
+        assert(xmin <= xmax);
+        assert(ymin <= ymax);
+        cells = CellRect{xmin, ymin, xmax, ymax};
+
+        /*SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255);
+        debug_draw_range(make_pair(interleave(xmin, ymin), interleave(xmax, ymax)));*/
+
+        // snap to a suitable power of two block size (which may cause us to search a larger
+        // area than necessary, but it reduces the number of ranges we need to search)
+        u32 xblock = calc_block_size(xmax - xmin);
+        u32 yblock = calc_block_size(ymax - ymin);
+        u32 block = max(xblock, yblock);
+        u32 xmin2 = snap_min(xmin, block);
+        u32 ymin2 = snap_min(ymin, block);
+        u32 xmax2 = snap_max(xmax, block);
+        u32 ymax2 = snap_max(ymax, block);
+
+        u32 budget = max(range_budget, 1u);
+        if (budget > max_range_budget)
+            budget = max_range_budget;
+        u32 count = partition_range(xmin2, ymin2, xmax2, ymax2, out, budget, occupied(shape), min_split);
+
+        for (u32 i = 0; i < count; ++i) {
+            assert(out[i].second >= out[i].first);
+            if (i > 0)
+                assert(out[i].first > out[i-1].second);
+        }
+        return count;
+    }
+
+    // append the ids of the keys in the sorted ranges that are in cells to
+    // result. returns the number of keys scanned, when CollectStats is set
+    u64 scan_ranges(const pair<Key,Key> *ranges, u32 range_count, const CellRect &cells,
+                    vector<u32> &result) const {
+        //u32 c = 21;
+        const Key *zbegin = zvalues.data();
+        const Key *zend = zbegin + zvalues.size();
+        const Key *it = zbegin;
+        u64 scanned = 0;
+
+        for (u32 i = 0; i < range_count; ++i) {
+            pair<Key,Key> r = ranges[i];
+            if (it == zend)
+                break;
+            // the scan of an earlier range may already have stopped past this one
+            if (*it > r.second)
+                continue;
+
+            /*c += 21;
+            SDL_SetRenderDrawColor(renderer, c, c, c, 255);
+            debug_draw_range(r);*/
+
+            it = seek(it, r.first);
+            const Key *scan_start = it;
+            it = scan_range(it, zend, r.second, cells, ids.data() + (it - zbegin), result);
+
+            if (CollectStats)
+                scanned += it - scan_start;
+        }
+        return scanned;
+    }
+
+    void area_lookup(v2 p0, v2 p1, vector<u32> &result, QueryScratch<Key> &scratch) const {
+        result.clear();
+        if (zvalues.empty() || !is_size_valid())
+            return;
+
+        CellRect cells;
+        scratch.range_count = plan_area_query(p0, p1, cells, scratch.ranges);
+        u64 scanned = scan_ranges(scratch.ranges, scratch.range_count, cells, result);
+
+        if (CollectStats) {
+            scratch.stats.queries += 1;
+            scratch.stats.ranges += scratch.range_count;
+            scratch.stats.keys_scanned += scanned;
+            scratch.stats.false_positives += scanned - result.size();
+            scratch.stats.results += result.size();
+        }
+
+        /*SDL_SetRenderDrawColor(renderer, 128, 128, 128, 255);
+        debug_draw_rect(xmin, ymin, xmax, ymax);
+
+        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+        debug_draw_rect(orig_xmin, orig_ymin, orig_xmax, orig_ymax);*/
+    }
+
+    void area_lookup(v2 p0, v2 p1, vector<u32> &result) {
+        area_lookup(p0, p1, result, default_scratch);
+    }
+
+    // answer many area lookups at once. the ids found by query i end up in
+    // result[offsets[i]..offsets[i+1]), in the same order area_lookup gives
+    // them. all queries are planned first. when the index is large and the
+    // queries scan enough keys for each range, the ranges of all of them are
+    // then scanned in one forward sweep through zvalues (see batch_sweep).
+    // otherwise the queries are scanned one after the other, as area_lookup
+    // would, straight into result
+    void area_lookup_batch(const AreaQuery *queries, u32 count, vector<u32> &offsets,
+                           vector<u32> &result, QueryScratch<Key> &scratch) const {
+        offsets.assign(count + 1, 0);
+        result.clear();
+        if (zvalues.empty() || !is_size_valid())
+            return;
+
+        // plan all the queries up front, keeping their ranges one after the
+        // other, and the cells they cover in total
+        scratch.batch_cells.resize(count);
+        scratch.batch_range_offsets.resize(count + 1);
+        scratch.batch_ranges.clear();
+        f64 cell_count = 0;
+        for (u32 q = 0; q < count; ++q) {
+            scratch.batch_range_offsets[q] = (u32)scratch.batch_ranges.size();
+            CellRect &cells = scratch.batch_cells[q];
+            u32 range_count = plan_area_query(queries[q].p0, queries[q].p1, cells, scratch.ranges);
+            scratch.batch_ranges.insert(scratch.batch_ranges.end(), scratch.ranges, scratch.ranges + range_count);
+            if (range_count > 0)
+                cell_count += ((f64)cells.xmax - cells.xmin + 1) * ((f64)cells.ymax - cells.ymin + 1);
+        }
+        u32 range_count = (u32)scratch.batch_ranges.size();
+        scratch.batch_range_offsets[count] = range_count;
+
+        // the sweep pays for sorting the ranges, and for moving the hits to
+        // their queries afterwards. that only comes back once the searches
+        // for the range starts miss the cache, and there are enough keys in
+        // each range to share between the queries, but not so many that
+        // moving the hits costs more. the keys are taken to be spread evenly
+        // over the occupied blocks, so that clustered points don't pass for
+        // sparse ones
+        f64 used_cells = ((f64)M::coord_max + 1) * ((f64)M::coord_max + 1);
+        if (has_occupancy)
+            used_cells = (f64)occupancy.count_set() * (f64)((u64)1 << occupancy_shift);
+        f64 keys_per_range = range_count > 0 ? cell_count * zvalues.size() / used_cells / range_count : 0;
+        u64 scanned;
+        if (zvalues.size() >= batch_sweep_min_keys && keys_per_range >= batch_sweep_min_keys_per_range &&
+            keys_per_range <= batch_sweep_max_keys_per_range) {
+            scanned = batch_sweep(count, offsets, result, scratch);
+        } else {
+            scanned = 0;
+            for (u32 q = 0; q < count; ++q) {
+                u32 first = scratch.batch_range_offsets[q];
+                // copied so that the stores to result can't alias them
+                CellRect cells = scratch.batch_cells[q];
+                scanned += scan_ranges(scratch.batch_ranges.data() + first,
+                                       scratch.batch_range_offsets[q + 1] - first, cells, result);
+                offsets[q + 1] = (u32)result.size();
+            }
+        }
+
+        if (CollectStats) {
+            scratch.stats.queries += count;
+            scratch.stats.ranges += range_count;
+            scratch.stats.keys_scanned += scanned;
+            scratch.stats.false_positives += scanned - result.size();
+            scratch.stats.results += result.size();
+        }
+    }
+
+    // the smallest index, and the keys each range is expected to scan, for
+    // which area_lookup_batch sweeps
+    static const u32 batch_sweep_min_keys = 1 << 22;
+    static const u32 batch_sweep_min_keys_per_range = 4;
+    static const u32 batch_sweep_max_keys_per_range = 128;
+
+    // scan the ranges planned by area_lookup_batch in the order of their first
+    // key, so each search for a range start only moves forward a little from
+    // the last one, and queries that overlap read the same keys while they are
+    // still in cache. the hits of each range go to batch_hits in that order,
+    // and are then moved to their query's place in result with a counting
+    // sort, which keeps the ranges of a query in order. returns the number of
+    // keys scanned, when CollectStats is set
+    u64 batch_sweep(u32 count, vector<u32> &offsets, vector<u32> &result, QueryScratch<Key> &scratch) const {
+        u32 range_count = (u32)scratch.batch_ranges.size();
+        scratch.batch_starts.resize(range_count);
+        scratch.batch_order.resize(range_count);
+        for (u32 i = 0; i < range_count; ++i) {
+            scratch.batch_starts[i] = scratch.batch_ranges[i].first;
+            scratch.batch_order[i] = i;
+        }
+        radix_sort(scratch.batch_starts, scratch.batch_order, scratch.batch_start_scratch, scratch.batch_order_scratch);
+
+        // the query of each range, by position in batch_ranges
+        scratch.batch_range_query.resize(range_count);
+        for (u32 q = 0; q < count; ++q) {
+            for (u32 i = scratch.batch_range_offsets[q]; i < scratch.batch_range_offsets[q + 1]; ++i)
+                scratch.batch_range_query[i] = q;
+        }
+
+        // the scans of different queries may overlap, so only the start of
+        // each one moves forward
+        const Key *zbegin = zvalues.data();
+        const Key *zend = zbegin + zvalues.size();
+        const Key *start = zbegin;
+        u64 scanned = 0;
+        scratch.batch_hits.clear();
+        scratch.batch_spans.resize(range_count);
+        for (u32 o = 0; o < range_count; ++o) {
+            u32 i = scratch.batch_order[o];
+            Key last = scratch.batch_ranges[i].second;
+            u32 q = scratch.batch_range_query[i];
+            // copied so that the stores to batch_hits can't alias them
+            CellRect cells = scratch.batch_cells[q];
+            start = seek(start, scratch.batch_starts[o]);
+            u32 first_hit = (u32)scratch.batch_hits.size();
+            const Key *end = scan_range(start, zend, last, cells, ids.data() + (start - zbegin), scratch.batch_hits);
+            scratch.batch_spans[o] = make_pair(q, (u32)scratch.batch_hits.size() - first_hit);
+
+            if (CollectStats)
+                scanned += end - start;
+        }
+
+        for (u32 o = 0; o < range_count; ++o)
+            offsets[scratch.batch_spans[o].first + 1] += scratch.batch_spans[o].second;
+        for (u32 q = 0; q < count; ++q)
+            offsets[q + 1] += offsets[q];
+        scratch.batch_cursors.assign(offsets.begin(), offsets.end() - 1);
+        result.resize(scratch.batch_hits.size());
+        const u32 *hit = scratch.batch_hits.data();
+        for (u32 o = 0; o < range_count; ++o) {
+            u32 n = scratch.batch_spans[o].second;
+            if (n > 0) {
+                u32 &cursor = scratch.batch_cursors[scratch.batch_spans[o].first];
+                memcpy(&result[cursor], hit, n * sizeof(u32));
+                cursor += n;
+                hit += n;
+            }
+        }
+        return scanned;
+    }
+
+    void area_lookup_batch(const AreaQuery *queries, u32 count,
+                           vector<u32> &offsets, vector<u32> &result) {
+        area_lookup_batch(queries, count, offsets, result, default_scratch);
+    }
+
+    void area_lookup_batch(const vector<AreaQuery> &queries,
+                           vector<u32> &offsets, vector<u32> &result) {
+        area_lookup_batch(queries.data(), (u32)queries.size(), offsets, result);
+    }
+
+    // like area_lookup_batch, with the queries split over the threads of pool.
+    // each worker answers its queries into a buffer of its own, and the
+    // buffers are then copied to their place in result in parallel as well.
+    // the stats of each worker are kept in its scratch
+    void parallel_area_lookup(WorkerPool &pool, const AreaQuery *queries, u32 count,
+                              vector<u32> &offsets, vector<u32> &result,
+                              ParallelQueryScratch<Key> &parallel) const {
+        typedef typename ParallelQueryScratch<Key>::Span Span;
+        const u32 queries_per_chunk = 32;
+        const u32 copies_per_chunk = 256;
+
+        offsets.assign(count + 1, 0);
+        result.clear();
+        if (zvalues.empty() || !is_size_valid())
+            return;
+
+        parallel.workers.resize(pool.size());
+        parallel.hits.resize(pool.size());
+        parallel.results.resize(pool.size());
+        parallel.spans.resize(count);
+        for (u32 i = 0; i < pool.size(); ++i)
+            parallel.hits[i].clear();
+
+        pool.parallel_for(count, queries_per_chunk, [&](u32 worker, u32 begin, u32 end) {
+            QueryScratch<Key> &scratch = parallel.workers[worker];
+            vector<u32> &hits = parallel.hits[worker];
+            vector<u32> &found = parallel.results[worker];
+            for (u32 q = begin; q < end; ++q) {
+                area_lookup(queries[q].p0, queries[q].p1, found, scratch);
+                Span span = {worker, (u32)hits.size(), (u32)(hits.size() + found.size())};
+                parallel.spans[q] = span;
+                hits.insert(hits.end(), found.begin(), found.end());
+            }
+        });
+
+        for (u32 q = 0; q < count; ++q)
+            offsets[q + 1] = offsets[q] + (parallel.spans[q].end - parallel.spans[q].begin);
+        result.resize(offsets[count]);
+
+        pool.parallel_for(count, copies_per_chunk, [&](u32, u32 begin, u32 end) {
+            for (u32 q = begin; q < end; ++q) {
+                const Span &span = parallel.spans[q];
+                if (span.end > span.begin)
+                    memcpy(&result[offsets[q]], &parallel.hits[span.worker][span.begin],
+                           (span.end - span.begin) * sizeof(u32));
+            }
+        });
+    }
+
+    void parallel_area_lookup(WorkerPool &pool, const AreaQuery *queries, u32 count,
+                              vector<u32> &offsets, vector<u32> &result) {
+        parallel_area_lookup(pool, queries, count, offsets, result, default_parallel_scratch);
+    }
+
+    void parallel_area_lookup(WorkerPool &pool, const vector<AreaQuery> &queries,
+                              vector<u32> &offsets, vector<u32> &result) {
+        parallel_area_lookup(pool, queries.data(), (u32)queries.size(), offsets, result);
+    }
+
+    // the keys a quadrant on the boundary of a circle is expected to hold for
+    // radius_lookup to split it further. with fewer, scanning the keys of the
+    // part outside the circle costs less than the splits
+    static const u32 radius_split_keys = 2048;
+
+    // all points within radius of center. the circle's bounding box is split
+    // into z-ranges like in area_lookup, leaving out the quadrants that are
+    // outside the circle. the points in cells of the square inside the circle
+    // are kept as they are, the cells of the others are tested against the
+    // circle, and only the points in cells on its boundary have their
+    // positions looked up for the exact test
+    void radius_lookup(v2 center, f32 radius, vector<u32> &result, QueryScratch<Key> &scratch) const {
+        typedef typename M::Real Real;
+        result.clear();
+        if (zvalues.empty() || !is_size_valid() || !(radius >= 0))
+            return;
+
+        // the exact test below is done in f32, so distances that close to the
+        // radius are left to it
+        CircleShape circle(((f64)center.x - minpos.x) * (f64)scale.x, ((f64)center.y - minpos.y) * (f64)scale.y,
+                           1 / (f64)scale.x, 1 / (f64)scale.y, radius, radius / 65536.0, M::coord_max);
+        // quadrants on the boundary are split for as long as they are
+        // expected to hold radius_split_keys, taking the keys to be spread
+        // evenly over the grid
+        f64 cells_per_key = ((f64)M::coord_max + 1) * ((f64)M::coord_max + 1) / (f64)zvalues.size();
+        u32 min_split = max((u32)min(sqrt(radius_split_keys * cells_per_key), (f64)M::coord_max), 1u);
+        CellRect cells;
+        scratch.range_count = plan_area_query(center - v2{radius, radius}, center + v2{radius, radius}, cells,
+                                              scratch.ranges, circle, min_split);
+
+        // a cell is inside the square if all of it is, with half a cell of
+        // slack for rounding in the discretization. the edge cells hold the
+        // clamped points, which may be anywhere
+        Real half = (Real)radius * (Real)0.70710678;
+        Real x0 = ceil(((Real)center.x - half - minpos.x) * (Real)scale.x + (Real)0.5);
+        Real x1 = floor(((Real)center.x + half - minpos.x) * (Real)scale.x - (Real)1.5);
+        Real y0 = ceil(((Real)center.y - half - minpos.y) * (Real)scale.y + (Real)0.5);
+        Real y1 = floor(((Real)center.y + half - minpos.y) * (Real)scale.y - (Real)1.5);
+        Real edge_max = (Real)(M::coord_max - 1);
+        CellRect square = {1, 1, 0, 0};
+        if (x0 <= x1 && y0 <= y1 && x1 >= 1 && y1 >= 1 && x0 <= edge_max && y0 <= edge_max) {
+            square.xmin = (u32)max(x0, (Real)1);
+            square.ymin = (u32)max(y0, (Real)1);
+            square.xmax = (u32)min(x1, edge_max);
+            square.ymax = (u32)min(y1, edge_max);
+        }
+
+        const Key *zbegin = zvalues.data();
+        const Key *zend = zbegin + zvalues.size();
+        const Key *it = zbegin;
+        u64 scanned = 0;
+        SplitOutput split = {&result, &scratch.radius_candidates, 0, 0};
+
+        for (u32 i = 0; i < scratch.range_count && it != zend; ++i) {
+            pair<Key,Key> r = scratch.ranges[i];
+            if (*it > r.second)
+                continue;
+            it = seek(it, r.first);
+            const Key *scan_start = it;
+            it = scan_range_split(it, zend, r.second, cells, square, circle, ids.data() + (it - zbegin), split);
+
+            if (CollectStats)
+                scanned += it - scan_start;
+        }
+
+        // the test goes either way about as often on the boundary, and a
+        // branch on it would stall the position loads behind each miss
+        f32 radius_sq = radius * radius;
+        u32 count = (u32)split.inside_count;
+        result.resize(count + split.edge_count);
+        u32 *out = result.data();
+        const u32 *edge = scratch.radius_candidates.data();
+        for (u32 i = 0; i < split.edge_count; ++i) {
+            u32 id = edge[i];
+            out[count] = id;
+            count += sqrlen(id_positions[id] - center) <= radius_sq;
+        }
+        result.resize(count);
+
+        if (CollectStats) {
+            scratch.stats.queries += 1;
+            scratch.stats.ranges += scratch.range_count;
+            scratch.stats.keys_scanned += scanned;
+            scratch.stats.false_positives += scanned - result.size();
+            scratch.stats.results += result.size();
+        }
+    }
+
+    void radius_lookup(v2 center, f32 radius, vector<u32> &result) {
+        radius_lookup(center, radius, result, default_scratch);
+    }
+
+    // offer a candidate to the heap of the k best
+    inline void knn_push(QueryScratch<Key> &scratch, u32 id, v2 p, u32 k) const {
+        f32 d = sqrlen(id_positions[id] - p);
+        if (scratch.knn_heap.size() < k) {
+            scratch.knn_heap.push_back(make_pair(d, id));
+            std::push_heap(scratch.knn_heap.begin(), scratch.knn_heap.end());
+        } else if (d < scratch.knn_heap.front().first) {
+            std::pop_heap(scratch.knn_heap.begin(), scratch.knn_heap.end());
+            scratch.knn_heap.back() = make_pair(d, id);
+            std::push_heap(scratch.knn_heap.begin(), scratch.knn_heap.end());
+        }
+    }
+
+    // the k points nearest to p, closest first. searches a box of cells around
+    // p, growing it until the k-th best distance found so far lies inside the
+    // searched area. distances are measured on the real positions
+    void knn(v2 p, u32 k, vector<u32> &result, QueryScratch<Key> &scratch) const {
+        typedef typename M::Real Real;
+        result.clear();
+        scratch.knn_heap.clear();
+        if (k == 0 || zvalues.empty() || !is_size_valid())
+            return;
+
+        v2 c = clamp(p);
+        u64 cx = discretize_x(c.x);
+        u64 cy = discretize_y(c.y);
+        u64 coord_max = M::coord_max;
+
+        const Key *zbegin = zvalues.data();
+        const Key *zend = zbegin + zvalues.size();
+
+        // the points whose keys are next to the key of p are mostly close to p,
+        // so the k-th best distance among them gives the first search radius
+        const Key *zp = seek(zbegin, M::interleave((u32)cx, (u32)cy));
+        const Key *seed_begin = zp - zbegin > k ? zp - k : zbegin;
+        const Key *seed_end = zend - zp > k ? zp + k : zend;
+        for (const Key *it = seed_begin; it != seed_end; ++it)
+            knn_push(scratch, ids[it - zbegin], p, k);
+        u64 seed_r = coord_max;
+        if (scratch.knn_heap.size() == k)
+            seed_r = (u64)(sqrt((Real)scratch.knn_heap.front().first) * max(scale.x, scale.y)) + 1;
+        scratch.knn_heap.clear();
+
+        // but when those are far away, a box that should hold about k points
+        // if they were spread evenly is tried first
+        Real cells = (Real)(coord_max + 1) * (Real)(coord_max + 1);
+        u64 r = (u64)(sqrt(cells * k / zvalues.size()) * 0.5) + 1;
+        if (r > seed_r)
+            r = seed_r;
+
+        u32 budget = max(range_budget, 1u);
+        if (budget > max_range_budget)
+            budget = max_range_budget;
+        typename M::Scale cell;
+        cell.x = 1 / scale.x;
+        cell.y = 1 / scale.y;
+
+        // the box searched by the previous round. its points are already in
+        // the heap, so only the ring around it is looked at
+        bool have_prev = false;
+        u64 pxmin = 0, pymin = 0, pxmax = 0, pymax = 0;
+
+        for (;;) {
+            // snapped to blocks like in area_lookup, which keeps the number of
+            // splits in partition_range down for large boxes
+            u32 block = calc_block_size((u32)min(2 * r, coord_max));
+            u64 xmin = snap_min((u32)(cx > r ? cx - r : 0), block);
+            u64 ymin = snap_min((u32)(cy > r ? cy - r : 0), block);
+            u64 xmax = snap_max((u32)min(cx + r, coord_max), block);
+            u64 ymax = snap_max((u32)min(cy + r, coord_max), block);
+
+            RectShape rect;
+            scratch.range_count = partition_range((u32)xmin, (u32)ymin, (u32)xmax, (u32)ymax,
+                                                  scratch.ranges, budget, occupied(rect), 1);
+            MortonRect<Key> box(CellRect{(u32)xmin, (u32)ymin, (u32)xmax, (u32)ymax});
+            const Key *it = zbegin;
+            for (u32 i = 0; i < scratch.range_count && it != zend; ++i) {
+                pair<Key,Key> rg = scratch.ranges[i];
+                if (*it > rg.second)
+                    continue;
+                it = seek(it, rg.first);
+                for (; it != zend && *it <= rg.second; ++it) {
+                    if (!box.contains(*it))
+                        continue;
+                    u64 x = M::deinterleave_x(*it);
+                    u64 y = M::deinterleave_y(*it);
+                    if (have_prev && x >= pxmin && x <= pxmax && y >= pymin && y <= pymax)
+                        continue;
+                    if (scratch.knn_heap.size() == k) {
+                        // skip the point without looking up its position if
+                        // no part of its cell can beat the current k-th best
+                        Real gx = (Real)(x > cx ? x - cx : cx - x);
+                        Real gy = (Real)(y > cy ? y - cy : cy - y);
+                        gx = gx > 1 ? (gx - 1) * cell.x : 0;
+                        gy = gy > 1 ? (gy - 1) * cell.y : 0;
+                        if (gx * gx + gy * gy > (Real)scratch.knn_heap.front().first)
+                            continue;
+                    }
+                    knn_push(scratch, ids[it - zbegin], p, k);
+                }
+            }
+
+            if (xmin == 0 && ymin == 0 && xmax == coord_max && ymax == coord_max)
+                break;
+
+            // distance from p to the nearest side of the searched cells that
+            // still has unsearched cells beyond it
+            Real reach = std::numeric_limits<Real>::max();
+            if (xmin > 0)
+                reach = min(reach, (Real)p.x - (minpos.x + (Real)xmin / scale.x));
+            if (ymin > 0)
+                reach = min(reach, (Real)p.y - (minpos.y + (Real)ymin / scale.y));
+            if (xmax < coord_max)
+                reach = min(reach, (minpos.x + (Real)(xmax + 1) / scale.x) - (Real)p.x);
+            if (ymax < coord_max)
+                reach = min(reach, (minpos.y + (Real)(ymax + 1) / scale.y) - (Real)p.y);
+
+            u64 next_r = r * 2;
+            if (scratch.knn_heap.size() == k) {
+                Real best = sqrt((Real)scratch.knn_heap.front().first);
+                if (reach > 0 && best <= reach)
+                    break;
+                // grow straight to a box that holds the whole circle of the
+                // k-th best distance, the next round then finishes the search
+                Real cover = best * max(scale.x, scale.y) + 1;
+                if (cover < (Real)coord_max)
+                    next_r = max(r + 1, (u64)cover);
+            }
+            have_prev = true;
+            pxmin = xmin;
+            pymin = ymin;
+            pxmax = xmax;
+            pymax = ymax;
+            // the seed radius is known to hold k points, so don't go past it
+            if (r < seed_r && next_r > seed_r)
+                next_r = seed_r;
+            r = min(next_r, coord_max);
+        }
+
+        std::sort_heap(scratch.knn_heap.begin(), scratch.knn_heap.end());
+        result.resize(scratch.knn_heap.size());
+        for (u32 i = 0; i < scratch.knn_heap.size(); ++i)
+            result[i] = scratch.knn_heap[i].second;
+    }
+
+    void knn(v2 p, u32 k, vector<u32> &result) {
+        knn(p, k, result, default_scratch);
+    }
+
+
+    /*void debug_draw_range(pair<u32,u32> r) {
+        u32 zprev = r.first;
+        for (u32 z = zprev + 1; z <= r.second; zprev = z++) {
+            v2 p0 = from_z(zprev) * gridDim;
+            v2 p1 = from_z(z) * gridDim;
+            SDL_RenderDrawLine(renderer, (u32)p0.x, (u32)p0.y, (u32)p1.x, (u32)p1.y);
+        }
+    }
+
+    void debug_draw_rect(u32 xmin, u32 ymin, u32 xmax, u32 ymax) {
+        u32 zmin = interleave(xmin, ymin);
+        u32 zmax = interleave(xmax, ymax);
+        v2 p0 = from_z(zmin) * gridDim;
+        v2 p1 = from_z(zmax) * gridDim;
+        SDL_Rect rect;
+        rect.x = p0.x;
+        rect.y = p0.y;
+        rect.w = p1.x - p0.x;
+        rect.h = p1.y - p0.y;
+        SDL_RenderDrawRect(renderer, &rect);
+    }*/
+};
+
+// the layout of a frozen index on disk: this header, then the arrays at the
+// offsets it gives, each aligned to a cache line. written in the byte order of
+// the machine, which endian_check shows, and only opened on a machine that
+// matches it
+struct SnapshotHeader {
+    char magic[8];
+    u32 version;
+    u32 endian_check;
+    u32 key_size;
+    u32 count;
+    u32 block_count;
+    u32 packed_count;
+    u32 occupancy_words;
+    u32 occupancy_bits;
+    u32 occupancy_shift;
+    u32 has_occupancy;
+    u64 occupancy_limit;
+    v2 minpos;
+    v2 maxpos;
+    u32 fixed_bounds;
+    u32 range_budget;
+    // byte offsets of block_first, block_last, block_offsets, packed, ids,
+    // block_bits and the occupancy bitmap
+    u64 sections[7];
+};
+
+static const char snapshot_magic[8] = {'Z', 'O', 'R', 'D', 'S', 'N', 'A', 'P'};
+static const u32 snapshot_version = 1;
+static const u32 snapshot_endian_check = 0x01020304;
+static const u32 snapshot_alignment = 64;
+
+inline void init_snapshot_header(SnapshotHeader &header, u32 key_size) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+    header.version = snapshot_version;
+    header.endian_check = snapshot_endian_check;
+    header.key_size = key_size;
+}
+
+// the size in bytes of each section, in the order of SnapshotHeader::sections
+template<class Key>
+static void snapshot_section_sizes(const SnapshotHeader &header, size_t *sizes) {
+    sizes[0] = (size_t)header.block_count * sizeof(Key);
+    sizes[1] = (size_t)header.block_count * sizeof(Key);
+    sizes[2] = header.block_count > 0 ? ((size_t)header.block_count + 1) * sizeof(u32) : 0;
+    sizes[3] = (size_t)header.packed_count * sizeof(u32);
+    sizes[4] = (size_t)header.count * sizeof(u32);
+    sizes[5] = header.block_count;
+    sizes[6] = (size_t)header.occupancy_words * sizeof(u32);
+}
+
+inline u64 snapshot_align(u64 offset) {
+    return (offset + snapshot_alignment - 1) / snapshot_alignment * snapshot_alignment;
+}
+
+// a read-only copy of an index with its keys compressed, for large sets of
+// points that never move. the sorted keys are cut into blocks of 128, and each
+// block keeps its first key and the bit packed deltas between its keys, with
+// as many bits as the largest delta needs. a directory of the last key of each
+// block finds the block a range starts in, and only the blocks a query
+// touches are decoded. blocks of 64 bit keys whose deltas don't fit in 32
+// bits are stored as they are. only area lookups are supported.
+// bake() writes it to a file that open() maps back in without copying or
+// sorting anything, which is the fast way to load static layers
+template<class Key>
+struct BasicFrozenZOrderIndex {
+    typedef Morton<Key> M;
+    static const u32 block_size = QueryScratch<Key>::frozen_block_size;
+    // marks a block stored without packing
+    static const u8 raw_block = 0xff;
+    // the most words a block can take
+    static const u32 max_block_words = block_size * sizeof(Key) / sizeof(u32);
+
+    // the bounds, range budget and occupancy bitmap of the source index,
+    // without its keys. plans the lookups
+    BasicZOrderIndex<Key> grid;
+    u32 count;
+    u32 block_count;
+    // the arrays point into storage after freeze(), or into the mapped file
+    // after open(). block_offsets gives where each block starts in packed,
+    // and one past the end
+    const Key *block_first;
+    const Key *block_last;
+    const u8 *block_bits;
+    const u32 *block_offsets;
+    const u32 *packed;
+    const u32 *ids;
+    // used by the lookups that aren't given a scratch of their own
+    QueryScratch<Key> default_scratch;
+
+    BasicFrozenZOrderIndex() {
+        clear();
+    }
+
+    void clear() {
+        file.close();
+        storage = Storage();
+        count = 0;
+        block_count = 0;
+        point_at_storage();
+    }
+
+    template<bool CollectStats>
+    void freeze(const BasicZOrderIndex<Key, CollectStats> &index) {
+        clear();
+        grid.minpos = index.minpos;
+        grid.maxpos = index.maxpos;
+        grid.size = index.size;
+        grid.scale = index.scale;
+        grid.fixed_bounds = index.fixed_bounds;
+        grid.range_budget = index.range_budget;
+        grid.occupancy_bits = index.occupancy_bits;
+        grid.occupancy_shift = index.occupancy_shift;
+        grid.occupancy = index.occupancy;
+        grid.has_occupancy = index.has_occupancy;
+        grid.occupancy_limit = index.occupancy_limit;
+
+        count = (u32)index.zvalues.size();
+        block_count = (count + block_size - 1) / block_size;
+        storage.ids = index.ids;
+        storage.block_first.resize(block_count);
+        storage.block_last.resize(block_count);
+        storage.block_bits.resize(block_count);
+        storage.block_offsets.resize(block_count + 1);
+        vector<u32> &out = storage.packed;
+
+        u32 words[max_block_words];
+        for (u32 b = 0; b < block_count; ++b) {
+            const Key *keys = index.zvalues.data() + b * block_size;
+            u32 n = min(block_size, count - b * block_size);
+            storage.block_first[b] = keys[0];
+            storage.block_last[b] = keys[n - 1];
+            storage.block_offsets[b] = (u32)out.size();
+            u32 word_count = pack_keys(keys, n, storage.block_bits[b], words);
+            out.insert(out.end(), words, words + word_count);
+        }
+        storage.block_offsets[block_count] = (u32)out.size();
+        point_at_storage();
+    }
+
+    // pack the n sorted keys of a block into words, and set bits to the
+    // width of its deltas. returns the number of words
+    static u32 pack_keys(const Key *keys, u32 n, u8 &bits, u32 *words) {
+        Key largest = 0;
+        for (u32 j = 1; j < n; ++j)
+            largest = max(largest, (Key)(keys[j] - keys[j - 1]));
+        if ((u64)largest > 0xffffffffull) {
+            bits = raw_block;
+            memset(words, 0, max_block_words * sizeof(u32));
+            memcpy(words, keys, n * sizeof(Key));
+            return max_block_words;
+        }
+
+        // the padding past the last key repeats it
+        u32 deltas[block_size];
+        deltas[0] = 0;
+        for (u32 j = 1; j < block_size; ++j)
+            deltas[j] = j < n ? (u32)(keys[j] - keys[j - 1]) : 0;
+        bits = largest == 0 ? 0 : (u8)(highest_bit_position((u32)largest) + 1);
+        pack_block(deltas, bits, words);
+        return packed_words(bits);
+    }
+
+    // write the index to path in the snapshot format. returns false if the
+    // file couldn't be written
+    bool bake(const char *path) const {
+        SnapshotHeader header;
+        init_snapshot_header(header, sizeof(Key));
+        header.count = count;
+        header.block_count = block_count;
+        header.packed_count = packed_count();
+        header.occupancy_words = grid.occupancy.word_count();
+        header.occupancy_bits = grid.occupancy_bits;
+        header.occupancy_shift = grid.occupancy_shift;
+        header.has_occupancy = grid.has_occupancy;
+        header.occupancy_limit = grid.occupancy_limit;
+        header.minpos = grid.minpos;
+        header.maxpos = grid.maxpos;
+        header.fixed_bounds = grid.fixed_bounds;
+        header.range_budget = grid.range_budget;
+
+        const void *arrays[7] = {block_first, block_last, block_offsets, packed, ids, block_bits,
+                                 grid.occupancy.data()};
+        size_t sizes[7];
+        snapshot_section_sizes<Key>(header, sizes);
+        u64 offset = sizeof(header);
+        for (u32 i = 0; i < 7; ++i) {
+            offset = snapshot_align(offset);
+            header.sections[i] = offset;
+            offset += sizes[i];
+        }
+
+        FILE *f = fopen(path, "wb");
+        if (!f)
+            return false;
+        static const u8 padding[snapshot_alignment] = {};
+        bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+        u64 written = sizeof(header);
+        for (u32 i = 0; i < 7 && ok; ++i) {
+            u64 gap = header.sections[i] - written;
+            ok = (gap == 0 || fwrite(padding, (size_t)gap, 1, f) == 1) &&
+                 (sizes[i] == 0 || fwrite(arrays[i], sizes[i], 1, f) == 1);
+            written = header.sections[i] + sizes[i];
+        }
+        return fclose(f) == 0 && ok;
+    }
+
+    // map a file written by bake() and use it in place. returns false, and
+    // leaves the index empty, if the file is missing, was written by another
+    // version, key type or byte order, or doesn't hold what its header says
+    bool open(const char *path) {
+        clear();
+        if (!file.open(path))
+            return false;
+        if (!attach()) {
+            clear();
+            return false;
+        }
+        return true;
+    }
+
+    // the bytes taken by the keys, including the directory
+    size_t key_bytes() const {
+        return packed_count() * sizeof(u32) + (block_count + 1) * sizeof(u32) + block_count +
+               2 * block_count * sizeof(Key);
+    }
+
+    void decode(u32 block, QueryScratch<Key> &scratch) const {
+        const u32 *in = packed + block_offsets[block];
+        if (block_bits[block] == raw_block)
+            memcpy(scratch.block_keys, in, block_size * sizeof(Key));
+        else
+            decode_block(in, block_bits[block], block_first[block], scratch.block_keys, scratch.block_deltas);
+    }
+
+    void area_lookup(v2 p0, v2 p1, vector<u32> &result, QueryScratch<Key> &scratch) const {
+        result.clear();
+        if (count == 0 || !grid.is_size_valid())
+            return;
+
+        CellRect cells;
+        scratch.range_count = grid.plan_area_query(p0, p1, cells, scratch.ranges);
+
+        const Key *directory_end = block_last + block_count;
+        // the first block that may hold the next range, and the one in scratch
+        u32 block = 0;
+        u32 decoded = ~0u;
+        for (u32 i = 0; i < scratch.range_count; ++i) {
+            pair<Key,Key> r = scratch.ranges[i];
+            block = (u32)(gallop_lower_bound(block_last + block, directory_end, r.first) - block_last);
+            if (block == block_count)
+                break;
+
+            // scan blocks until one ends past the range
+            for (; block < block_count && block_first[block] <= r.second; ++block) {
+                if (block != decoded) {
+                    decode(block, scratch);
+                    decoded = block;
+                }
+                const Key *keys = scratch.block_keys;
+                const Key *end = keys + min(block_size, count - block * block_size);
+                const Key *start = branchless_lower_bound(keys, end, r.first);
+                const u32 *start_ids = ids + block * block_size + (start - keys);
+                if (scan_range(start, end, r.second, cells, start_ids, result) != end)
+                    break;
+            }
+        }
+    }
+
+    void area_lookup(v2 p0, v2 p1, vector<u32> &result) {
+        area_lookup(p0, p1, result, default_scratch);
+    }
+
+private:
+    struct Storage {
+        vector<Key> block_first;
+        vector<Key> block_last;
+        vector<u8> block_bits;
+        vector<u32> block_offsets;
+        vector<u32> packed;
+        vector<u32> ids;
+    };
+
+    Storage storage;
+    MappedFile file;
+
+    // the arrays point into themselves
+    BasicFrozenZOrderIndex(const BasicFrozenZOrderIndex &);
+    BasicFrozenZOrderIndex &operator=(const BasicFrozenZOrderIndex &);
+
+    u32 packed_count() const {
+        return block_count > 0 ? block_offsets[block_count] : 0;
+    }
+
+    void point_at_storage() {
+        block_first = storage.block_first.data();
+        block_last = storage.block_last.data();
+        block_bits = storage.block_bits.data();
+        block_offsets = storage.block_offsets.data();
+        packed = storage.packed.data();
+        ids = storage.ids.data();
+    }
+
+    // check the header and the sections of the mapped file, and point the
+    // arrays into it
+    bool attach() {
+        const u8 *data = file.data();
+        if (file.size() < sizeof(SnapshotHeader))
+            return false;
+        SnapshotHeader header;
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, snapshot_magic, sizeof(header.magic)) != 0 ||
+            header.version != snapshot_version || header.endian_check != snapshot_endian_check ||
+            header.key_size != sizeof(Key))
+            return false;
+        if (header.block_count != (header.count + block_size - 1) / block_size)
+            return false;
+
+        size_t sizes[7];
+        snapshot_section_sizes<Key>(header, sizes);
+        for (u32 i = 0; i < 7; ++i) {
+            if (header.sections[i] % snapshot_alignment != 0 || header.sections[i] > file.size() ||
+                sizes[i] > file.size() - header.sections[i])
+                return false;
+        }
+        // the mapping is page aligned, so the sections are too, but the
+        // compiler is not told that
+        if ((size_t)data % snapshot_alignment != 0)
+            return false;
+
+        count = header.count;
+        block_count = header.block_count;
+        block_first = (const Key *)(data + header.sections[0]);
+        block_last = (const Key *)(data + header.sections[1]);
+        block_offsets = (const u32 *)(data + header.sections[2]);
+        packed = (const u32 *)(data + header.sections[3]);
+        ids = (const u32 *)(data + header.sections[4]);
+        block_bits = (const u8 *)(data + header.sections[5]);
+        // the block offsets must stay inside packed for decode() to be safe
+        if (block_count > 0 && block_offsets[block_count] != header.packed_count)
+            return false;
+        for (u32 b = 0; b < block_count; ++b) {
+            u32 words = block_bits[b] == raw_block ? max_block_words
+                                                   : block_bits[b] <= 32 ? packed_words(block_bits[b]) : ~0u;
+            if (block_offsets[b] > header.packed_count || words > header.packed_count - block_offsets[b])
+                return false;
+        }
+
+        // lookups ask the bitmap about the blocks up to that of
+        // occupancy_limit, so all of them must be in it, and the shift and
+        // the block numbers must fit their types
+        if (header.has_occupancy > 1)
+            return false;
+        if (header.has_occupancy) {
+            if (header.occupancy_bits == 0 || header.occupancy_bits > 32 ||
+                header.occupancy_shift >= sizeof(Key) * 8 || (u64)(Key)header.occupancy_limit != header.occupancy_limit)
+                return false;
+            u64 last_block = header.occupancy_limit >> header.occupancy_shift;
+            if ((last_block >> header.occupancy_bits) != 0 || last_block / 32 >= header.occupancy_words)
+                return false;
+        }
+
+        // the bitmap is small, and is copied
+        grid.minpos = header.minpos;
+        grid.maxpos = header.maxpos;
+        grid.size = header.maxpos - header.minpos;
+        grid.scale = M::discretize_scale(grid.size);
+        grid.fixed_bounds = header.fixed_bounds != 0;
+        grid.range_budget = header.range_budget;
+        grid.occupancy_bits = header.occupancy_bits;
+        grid.occupancy_shift = header.occupancy_shift;
+        grid.occupancy.assign((const u32 *)(data + header.sections[6]), header.occupancy_words);
+        grid.has_occupancy = header.has_occupancy != 0;
+        grid.occupancy_limit = (Key)header.occupancy_limit;
+        return true;
+    }
+};
+
+// std::min and std::max take these by reference
+template<class Key> const u32 BasicFrozenZOrderIndex<Key>::block_size;
+template<class Key> const u8 BasicFrozenZOrderIndex<Key>::raw_block;
+template<class Key> const u32 BasicFrozenZOrderIndex<Key>::max_block_words;
+
+#ifndef _WIN32
+static_assert(sizeof(off_t) >= 8, "off_t has 32 bits, define _FILE_OFFSET_BITS as 64 before any include");
+#endif
+
+// seek to a byte offset that may be past 4 GB
+inline bool seek_file(FILE *file, u64 offset) {
+#ifdef _WIN32
+    return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+// writes a snapshot for BasicFrozenZOrderIndex::open from more points than
+// fit in memory. the points are added in chunks under fixed bounds, and each
+// time the buffer fills up it is sorted and spilled to a temporary file as a
+// run. finish() merges the runs straight into the blocks of the snapshot, so
+// the whole set is never held at once. memory stays near memory_budget bytes,
+// plus 64 KB for each section being written
+template<class Key>
+struct BasicZOrderStreamBuilder {
+    typedef Morton<Key> M;
+    typedef BasicFrozenZOrderIndex<Key> Frozen;
+    // the next key of a run and the run, in the merge heap
+    typedef pair<Key, u32> Record;
+    // a key and its id in a run file, packed without padding
+    static const u32 record_bytes = sizeof(Key) + sizeof(u32);
+    static const u32 block_size = Frozen::block_size;
+    // the smallest run and read buffer, however small the budget
+    static const u32 min_run_records = 4096;
+    static const u32 min_read_records = 256;
+    static const u32 writer_buffer_bytes = 64 * 1024;
+
+    // the bounds, range budget and occupancy bits of the snapshot. has no keys
+    BasicZOrderIndex<Key> grid;
+
+    BasicZOrderStreamBuilder() {
+        run_capacity = 0;
+        memory_budget = 0;
+        run_count = 0;
+        total_count = 0;
+        next_id = 0;
+        max_key = 0;
+        failed = false;
+    }
+
+    ~BasicZOrderStreamBuilder() {
+        remove_runs();
+    }
+
+    // start a build of points inside lo..hi, which are the bounds of the
+    // snapshot. points outside them are clamped onto the edges. the runs are
+    // written to temp_prefix.run0, temp_prefix.run1 and so on
+    void begin(v2 lo, v2 hi, size_t budget, const char *temp_prefix) {
+        remove_runs();
+        grid.set_fixed_bounds(lo, hi);
+        prefix.assign(temp_prefix, temp_prefix + strlen(temp_prefix) + 1);
+        memory_budget = budget;
+        // the keys and ids, and the scratch of the sort
+        run_capacity = (u32)min((size_t)0x7fffffff,
+                                max((size_t)min_run_records, budget / (2 * (sizeof(Key) + sizeof(u32)))));
+        keys.clear();
+        run_ids.clear();
+        keys.reserve(run_capacity);
+        run_ids.reserve(run_capacity);
+        total_count = 0;
+        next_id = 0;
+        max_key = 0;
+        failed = false;
+    }
+
+    // add a chunk of points. they are identified by the corresponding entry
+    // in point_ids, or without point_ids by the order they are added in over
+    // all chunks, as make_index does. returns false once a run couldn't be
+    // written
+    bool add(const v2 *points, u32 count, const u32 *point_ids = 0) {
+        while (count > 0 && !failed) {
+            u32 used = (u32)keys.size();
+            u32 n = min(count, run_capacity - used);
+            keys.resize(used + n);
+            run_ids.resize(used + n);
+            M::encode_points(points, n, grid.minpos, grid.scale, keys.data() + used);
+            for (u32 i = 0; i < n; ++i)
+                run_ids[used + i] = point_ids ? point_ids[i] : next_id + i;
+            next_id += n;
+            points += n;
+            if (point_ids)
+                point_ids += n;
+            count -= n;
+            if (keys.size() == run_capacity)
+                spill_run();
+        }
+        return !failed;
+    }
+
+    // merge the runs into a snapshot at path and remove them. returns false
+    // if a file couldn't be read or written, or there were 2^32 points or more
+    bool finish(const char *path) {
+        if (!keys.empty())
+            spill_run();
+        // the merge takes the budget over from the run buffers
+        vector<Key>().swap(keys);
+        vector<u32>().swap(run_ids);
+        vector<Key>().swap(key_scratch);
+        vector<u32>().swap(id_scratch);
+        bool ok = !failed && total_count <= 0xffffffffull && merge(path);
+        remove_runs();
+        return ok;
+    }
+
+private:
+    struct RunReader {
+        FILE *file;
+        vector<u8> buffer;
+        u32 pos;
+        u32 size;
+        u64 remaining;
+
+        Key key() const {
+            Key key;
+            memcpy(&key, buffer.data() + (size_t)pos * record_bytes, sizeof(Key));
+            return key;
+        }
+
+        u32 id() const {
+            u32 id;
+            memcpy(&id, buffer.data() + (size_t)pos * record_bytes + sizeof(Key), sizeof(u32));
+            return id;
+        }
+    };
+
+    // buffers the writes to one section of the snapshot, which starts at a
+    // known offset
+    struct SectionWriter {
+        FILE *file;
+        u64 offset;
+        vector<u8> buffer;
+        bool ok;
+
+        void start(FILE *f, u64 at) {
+            file = f;
+            offset = at;
+            buffer.clear();
+            buffer.reserve(writer_buffer_bytes);
+            ok = true;
+        }
+
+        void write(const void *data, size_t bytes) {
+            const u8 *p = (const u8 *)data;
+            buffer.insert(buffer.end(), p, p + bytes);
+            if (buffer.size() >= writer_buffer_bytes)
+                flush();
+        }
+
+        void flush() {
+            if (buffer.empty())
+                return;
+            ok = ok && seek_file(file, offset) && fwrite(buffer.data(), buffer.size(), 1, file) == 1;
+            offset += buffer.size();
+            buffer.clear();
+        }
+    };
+
+    vector<char> prefix;
+    size_t memory_budget;
+    u32 run_capacity;
+    vector<Key> keys;
+    vector<u32> run_ids;
+    vector<Key> key_scratch;
+    vector<u32> id_scratch;
+    // the number of points in each run
+    vector<u32> run_sizes;
+    u32 run_count;
+    u64 total_count;
+    u32 next_id;
+    Key max_key;
+    bool failed;
+
+    BasicZOrderStreamBuilder(const BasicZOrderStreamBuilder &);
+    BasicZOrderStreamBuilder &operator=(const BasicZOrderStreamBuilder &);
+
+    void run_path(u32 run, vector<char> &path) const {
+        path.resize(prefix.size() + 16);
+#if defined(_MSC_VER) && _MSC_VER < 1900
+        _snprintf(path.data(), path.size(), "%s.run%u", prefix.data(), run);
+#else
+        snprintf(path.data(), path.size(), "%s.run%u", prefix.data(), run);
+#endif
+    }
+
+    void remove_runs() {
+        vector<char> path;
+        for (u32 run = 0; run < run_count; ++run) {
+            run_path(run, path);
+            remove(path.data());
+        }
+        run_count = 0;
+        run_sizes.clear();
+    }
+
+    // sort the buffer, which keeps points with the same key in the order they
+    // were added, and write it out as the next run
+    void spill_run() {
+        radix_sort(keys, run_ids, key_scratch, id_scratch);
+        u32 n = (u32)keys.size();
+        max_key = max(max_key, keys.back());
+
+        vector<char> path;
+        run_path(run_count, path);
+        FILE *f = fopen(path.data(), "wb");
+        // counted before writing, so a partial run is removed too
+        ++run_count;
+        run_sizes.push_back(n);
+        bool ok = f != 0;
+        u8 records[1024 * record_bytes];
+        for (u32 i = 0; i < n && ok; i += 1024) {
+            u32 m = min(1024u, n - i);
+            for (u32 j = 0; j < m; ++j) {
+                memcpy(records + j * record_bytes, &keys[i + j], sizeof(Key));
+                memcpy(records + j * record_bytes + sizeof(Key), &run_ids[i + j], sizeof(u32));
+            }
+            ok = fwrite(records, record_bytes, m, f) == m;
+        }
+        if (f && fclose(f) != 0)
+            ok = false;
+        failed = failed || !ok;
+        total_count += n;
+        keys.clear();
+        run_ids.clear();
+    }
+
+    static bool refill(RunReader &reader) {
+        u32 n = (u32)min((u64)(reader.buffer.size() / record_bytes), reader.remaining);
+        reader.pos = 0;
+        reader.size = n;
+        reader.remaining -= n;
+        return n > 0 && fread(reader.buffer.data(), record_bytes, n, reader.file) == n;
+    }
+
+    bool merge(const char *path) {
+        u32 count = (u32)total_count;
+        SnapshotHeader header;
+        init_snapshot_header(header, sizeof(Key));
+        header.count = count;
+        header.block_count = (count + block_size - 1) / block_size;
+        header.has_occupancy = grid.occupancy_bits > 0 && count > 0;
+        header.occupancy_bits = grid.occupancy_bits;
+        header.occupancy_limit = header.has_occupancy ? max_key : 0;
+        if (header.has_occupancy) {
+            u32 key_bits = highest_bit_position(max_key) + 1;
+            header.occupancy_shift = key_bits > grid.occupancy_bits ? key_bits - grid.occupancy_bits : 0;
+        }
+        header.minpos = grid.minpos;
+        header.maxpos = grid.maxpos;
+        header.fixed_bounds = 1;
+        header.range_budget = grid.range_budget;
+
+        // all sections but packed and the bitmap have sizes known from the
+        // count alone, so those two go last and the rest are written in place
+        // as the merge goes
+        size_t sizes[7];
+        snapshot_section_sizes<Key>(header, sizes);
+        static const u32 known_sections[5] = {0, 1, 2, 4, 5};
+        u64 offset = sizeof(header);
+        for (u32 i = 0; i < 5; ++i) {
+            offset = snapshot_align(offset);
+            header.sections[known_sections[i]] = offset;
+            offset += sizes[known_sections[i]];
+        }
+        header.sections[3] = snapshot_align(offset);
+
+        FILE *out = fopen(path, "wb");
+        if (!out)
+            return false;
+        SectionWriter writers[6];
+        for (u32 i = 0; i < 6; ++i)
+            writers[i].start(out, header.sections[i]);
+        SectionWriter &first_writer = writers[0], &last_writer = writers[1], &offset_writer = writers[2],
+                      &packed_writer = writers[3], &id_writer = writers[4], &bits_writer = writers[5];
+
+        bool ok = true;
+        vector<RunReader> readers(run_count);
+        u32 read_records = (u32)max((size_t)min_read_records,
+                                    memory_budget / record_bytes / max(run_count, 1u));
+        vector<Record> heap;
+        heap.reserve(run_count);
+        vector<char> run_file;
+        for (u32 run = 0; run < run_count && ok; ++run) {
+            RunReader &reader = readers[run];
+            run_path(run, run_file);
+            reader.file = fopen(run_file.data(), "rb");
+            reader.buffer.resize((size_t)min(read_records, run_sizes[run]) * record_bytes);
+            reader.remaining = run_sizes[run];
+            ok = reader.file != 0 && refill(reader);
+            if (ok)
+                heap.push_back(Record(reader.key(), run));
+        }
+        // a min heap, where equal keys come out in run order and so in the
+        // order they were added
+        std::make_heap(heap.begin(), heap.end(), std::greater<Record>());
+
+        grid.occupancy.clear();
+        u32 last_occupied = ~0u;
+        Key block[block_size];
+        u32 block_fill = 0;
+        u32 packed_count = 0;
+        u32 words[Frozen::max_block_words];
+        while (!heap.empty() && ok) {
+            std::pop_heap(heap.begin(), heap.end(), std::greater<Record>());
+            u32 run = heap.back().second;
+            heap.pop_back();
+            RunReader &reader = readers[run];
+            Key key = reader.key();
+            u32 id = reader.id();
+            if (++reader.pos == reader.size && reader.remaining > 0)
+                ok = refill(reader);
+            if (reader.pos < reader.size) {
+                heap.push_back(Record(reader.key(), run));
+                std::push_heap(heap.begin(), heap.end(), std::greater<Record>());
+            }
+
+            id_writer.write(&id, sizeof(u32));
+            if (header.has_occupancy) {
+                u32 occupied = (u32)(key >> header.occupancy_shift);
+                if (occupied != last_occupied) {
+                    grid.occupancy.set(occupied, true);
+                    last_occupied = occupied;
+                }
+            }
+            block[block_fill++] = key;
+            if (block_fill == block_size || heap.empty()) {
+                u8 bits;
+                u32 word_count = Frozen::pack_keys(block, block_fill, bits, words);
+                first_writer.write(&block[0], sizeof(Key));
+                last_writer.write(&block[block_fill - 1], sizeof(Key));
+                offset_writer.write(&packed_count, sizeof(u32));
+                bits_writer.write(&bits, 1);
+                packed_writer.write(words, word_count * sizeof(u32));
+                packed_count += word_count;
+                block_fill = 0;
+            }
+        }
+        for (u32 run = 0; run < run_count; ++run) {
+            if (readers[run].file)
+                fclose(readers[run].file);
+        }
+        if (header.block_count > 0)
+            offset_writer.write(&packed_count, sizeof(u32));
+
+        // the end of what has been written, counting the header to come
+        u64 end = sizeof(header);
+        for (u32 i = 0; i < 6; ++i) {
+            writers[i].flush();
+            ok = ok && writers[i].ok;
+            if (writers[i].offset > header.sections[i])
+                end = max(end, writers[i].offset);
+        }
+        header.packed_count = packed_count;
+        header.occupancy_words = grid.occupancy.word_count();
+        header.sections[6] = snapshot_align(header.sections[3] + (u64)packed_count * sizeof(u32));
+
+        // pad out to the bitmap, which may be empty and still has to start
+        // inside the file
+        static const u8 padding[snapshot_alignment] = {};
+        ok = ok && seek_file(out, end);
+        for (; end < header.sections[6] && ok; end += snapshot_alignment)
+            ok = fwrite(padding, (size_t)min((u64)snapshot_alignment, header.sections[6] - end), 1, out) == 1;
+        ok = ok && seek_file(out, header.sections[6]) &&
+             (header.occupancy_words == 0 ||
+              fwrite(grid.occupancy.data(), header.occupancy_words * sizeof(u32), 1, out) == 1);
+        ok = ok && seek_file(out, 0) && fwrite(&header, sizeof(header), 1, out) == 1;
+        grid.occupancy.clear();
+        return fclose(out) == 0 && ok;
+    }
+};
+
+typedef BasicZOrderIndex<u32> ZOrderIndex;
+// for large worlds where 16 bits per axis is too coarse
+typedef BasicZOrderIndex<u64> ZOrderIndex64;
+typedef BasicFrozenZOrderIndex<u32> FrozenZOrderIndex;
+typedef BasicFrozenZOrderIndex<u64> FrozenZOrderIndex64;
+typedef BasicZOrderStreamBuilder<u32> ZOrderStreamBuilder;
+typedef BasicZOrderStreamBuilder<u64> ZOrderStreamBuilder64;
 
 
 
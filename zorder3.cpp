@@ -0,0 +1,406 @@
+// 3d counterpart of zorder.cpp, for box queries over points with height.
+// shares the cpu dispatch, snapping and sorting code with the 2d index
+
+namespace zorder3 {
+
+using zorder::calc_block_size;
+using zorder::snap_min;
+using zorder::snap_max;
+using zorder::highest_bit_position;
+
+
+// intersperses the lower 10 bits of x with pairs of zeroes
+inline u32 intersperse_zeroes_portable(u32 x) {
+    x &= 0x000003ff;
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x << 8)) & 0x0300f00f;
+    x = (x | (x << 4)) & 0x030c30c3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+
+// extract the x part of the interleaved numbers
+inline u32 deinterleave_x_portable(u32 z) {
+    z &= 0x09249249;
+    z = (z | (z >> 2)) & 0x030c30c3;
+    z = (z | (z >> 4)) & 0x0300f00f;
+    z = (z | (z >> 8)) & 0x030000ff;
+    z = (z | (z >> 16)) & 0x000003ff;
+    return z;
+}
+
+
+// intersperses the lower 21 bits of x with pairs of zeroes
+inline u64 intersperse_zeroes64_portable(u32 x) {
+    u64 w = x & 0x1fffff;
+    w = (w | (w << 32)) & 0x001f00000000ffffull;
+    w = (w | (w << 16)) & 0x001f0000ff0000ffull;
+    w = (w | (w << 8)) & 0x100f00f00f00f00full;
+    w = (w | (w << 4)) & 0x10c30c30c30c30c3ull;
+    w = (w | (w << 2)) & 0x1249249249249249ull;
+    return w;
+}
+
+
+// extract the x part of the 64 bit interleaved numbers
+inline u32 deinterleave_x64_portable(u64 z) {
+    z &= 0x1249249249249249ull;
+    z = (z | (z >> 2)) & 0x10c30c30c30c30c3ull;
+    z = (z | (z >> 4)) & 0x100f00f00f00f00full;
+    z = (z | (z >> 8)) & 0x001f0000ff0000ffull;
+    z = (z | (z >> 16)) & 0x001f00000000ffffull;
+    z = (z | (z >> 32)) & 0x00000000001fffffull;
+    return (u32)z;
+}
+
+
+#ifdef ZORDER_X86
+
+ZORDER_TARGET_BMI2 inline u32 intersperse_zeroes_bmi2(u32 x) {
+    return _pdep_u32(x, 0x09249249);
+}
+
+ZORDER_TARGET_BMI2 inline u32 deinterleave_x_bmi2(u32 z) {
+    return _pext_u32(z, 0x09249249);
+}
+
+#ifdef ZORDER_X64
+ZORDER_TARGET_BMI2 inline u64 intersperse_zeroes64_bmi2(u32 x) {
+    return _pdep_u64(x, 0x1249249249249249ull);
+}
+
+ZORDER_TARGET_BMI2 inline u32 deinterleave_x64_bmi2(u64 z) {
+    return (u32)_pext_u64(z, 0x1249249249249249ull);
+}
+#endif
+
+#endif
+
+
+inline u32 intersperse_zeroes(u32 x) {
+#ifdef ZORDER_X86
+    if (zorder::use_bmi2)
+        return intersperse_zeroes_bmi2(x);
+#endif
+    return intersperse_zeroes_portable(x);
+}
+
+// interleave the lower 10 bits of the three arguments
+inline u32 interleave(u32 x, u32 y, u32 z) {
+    return intersperse_zeroes(x) | (intersperse_zeroes(y) << 1) | (intersperse_zeroes(z) << 2);
+}
+
+inline u32 deinterleave_x(u32 k) {
+#ifdef ZORDER_X86
+    if (zorder::use_bmi2)
+        return deinterleave_x_bmi2(k);
+#endif
+    return deinterleave_x_portable(k);
+}
+
+inline u32 deinterleave_y(u32 k) {
+    return deinterleave_x(k >> 1);
+}
+
+inline u32 deinterleave_z(u32 k) {
+    return deinterleave_x(k >> 2);
+}
+
+
+inline u64 intersperse_zeroes64(u32 x) {
+#ifdef ZORDER_X64
+    if (zorder::use_bmi2)
+        return intersperse_zeroes64_bmi2(x);
+#endif
+    return intersperse_zeroes64_portable(x);
+}
+
+// interleave the lower 21 bits of the three arguments
+inline u64 interleave64(u32 x, u32 y, u32 z) {
+    return intersperse_zeroes64(x) | (intersperse_zeroes64(y) << 1) | (intersperse_zeroes64(z) << 2);
+}
+
+inline u32 deinterleave_x64(u64 k) {
+#ifdef ZORDER_X64
+    if (zorder::use_bmi2)
+        return deinterleave_x64_bmi2(k);
+#endif
+    return deinterleave_x64_portable(k);
+}
+
+inline u32 deinterleave_y64(u64 k) {
+    return deinterleave_x64(k >> 1);
+}
+
+inline u32 deinterleave_z64(u64 k) {
+    return deinterleave_x64(k >> 2);
+}
+
+
+// everything that depends on the key width. u32 keys give 10 bits per axis and
+// u64 keys 21 bits per axis
+template<class Key> struct Morton3;
+
+template<> struct Morton3<u32> {
+    static const u32 axis_bits = 10;
+    static const u32 coord_max = 0x3ff;
+
+    static u32 interleave(const u32 c[3]) { return zorder3::interleave(c[0], c[1], c[2]); }
+    static void deinterleave(u32 k, u32 c[3]) {
+        c[0] = deinterleave_x(k);
+        c[1] = deinterleave_y(k);
+        c[2] = deinterleave_z(k);
+    }
+};
+
+template<> struct Morton3<u64> {
+    static const u32 axis_bits = 21;
+    static const u32 coord_max = 0x1fffff;
+
+    static u64 interleave(const u32 c[3]) { return interleave64(c[0], c[1], c[2]); }
+    static void deinterleave(u64 k, u32 c[3]) {
+        c[0] = deinterleave_x64(k);
+        c[1] = deinterleave_y64(k);
+        c[2] = deinterleave_z64(k);
+    }
+};
+
+
+// partition the box into several subranges, where each subrange contains as
+// few coordinates as possible that are outside its box. works like the 2d
+// version, except the highest differing bit may belong to any of three axes
+template<class Key>
+static u32 partition_range(const u32 lo[3], const u32 hi[3],
+                           pair<Key,Key> *ranges, u32 max_ranges)
+{
+    typedef Morton3<Key> M;
+    struct Box {
+        u32 lo[3], hi[3];
+    };
+
+    Box stack[sizeof(Key) * 8 + 1];
+    u32 depth = 0;
+    u32 count = 0;
+    stack[depth++] = Box{{lo[0], lo[1], lo[2]}, {hi[0], hi[1], hi[2]}};
+
+    while (depth > 0) {
+        Box b = stack[--depth];
+        Key min = M::interleave(b.lo);
+        Key max = M::interleave(b.hi);
+        assert(min <= max);
+
+        f64 zrange = (f64)(max - min) + 1;
+        f64 volume = 1;
+        for (u32 axis = 0; axis < 3; ++axis) {
+            assert(b.lo[axis] <= b.hi[axis]);
+            volume *= (f64)(b.hi[axis] - b.lo[axis]) + 1;
+        }
+        if (zrange <= volume * 1.1 + 4) {
+            zorder::append_range(ranges, count, max_ranges, make_pair(min, max));
+            continue;
+        }
+
+        // split along the axis owning the highest differing bit. LITMAX keeps
+        // the lower part of that axis, BIGMIN the upper
+        u32 first_diffbit = highest_bit_position(min ^ max);
+        u32 axis = first_diffbit % 3;
+        u32 bit = first_diffbit / 3;
+        u32 diffmask = M::coord_max >> (M::axis_bits - bit - 1);
+        u32 same_highbits = ~diffmask & b.lo[axis];
+
+        Box litmax = b;
+        Box bigmin = b;
+        litmax.hi[axis] = same_highbits | (diffmask >> 1);
+        bigmin.lo[axis] = litmax.hi[axis] + 1;
+
+        assert(depth + 2 <= sizeof(stack) / sizeof(stack[0]));
+        stack[depth++] = bigmin;
+        stack[depth++] = litmax;
+    }
+
+    return count;
+}
+
+
+static void compute_bounds(const v3 *points, u32 count, v3 &min, v3 &max) {
+    min = v3{FLT_MAX, FLT_MAX, FLT_MAX};
+    max = v3{-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for (u32 i = 0; i < count; ++i) {
+        v3 p = points[i];
+        for (u32 axis = 0; axis < 3; ++axis) {
+            if (p[axis] < min[axis]) min[axis] = p[axis];
+            if (p[axis] > max[axis]) max[axis] = p[axis];
+        }
+    }
+}
+
+
+template<class Key>
+struct BasicZOrderIndex3 {
+    typedef Morton3<Key> M;
+
+    v3 minpos;
+    v3 maxpos;
+    v3 size;
+    v3 scale;
+    // when set, minpos/maxpos were given by the caller and are kept across
+    // builds. points outside them are clamped to the edge cells
+    bool fixed_bounds;
+    // sorted keys, with the caller's id for each key at the same position in ids
+    vector<Key> zvalues;
+    vector<u32> ids;
+    vector<Key> zvalue_scratch;
+    vector<u32> id_scratch;
+    static const u32 max_range_budget = 256;
+    pair<Key,Key> ranges[max_range_budget];
+    u32 range_count;
+    u32 range_budget;
+
+    BasicZOrderIndex3() {
+        range_budget = 64;
+        reset();
+    }
+
+    void reset() {
+        minpos = v3{0,0,0};
+        maxpos = v3{0,0,0};
+        size = v3{0,0,0};
+        scale = v3{0,0,0};
+        fixed_bounds = false;
+        zvalues.clear();
+        ids.clear();
+        range_count = 0;
+    }
+
+    // convert the real valued coordinate to a discrete representation in
+    // the lower M::axis_bits bits of the result, clamping to the grid
+    inline u32 discretize(f32 v, u32 axis) const {
+        f32 t = (v - minpos[axis]) * scale[axis];
+        t = t < 0.0f ? 0.0f : t;
+        t = t > (f32)M::coord_max ? (f32)M::coord_max : t;
+        return (u32)t;
+    }
+
+    inline Key to_z(v3 p) const {
+        u32 c[3] = { discretize(p.x, 0), discretize(p.y, 1), discretize(p.z, 2) };
+        return M::interleave(c);
+    }
+
+    inline bool is_size_valid() const {
+        return fabs(size.x) > 0.01f && fabs(size.y) > 0.01f && fabs(size.z) > 0.01f;
+    }
+
+    // use the given world bounds for all following builds instead of the
+    // bounds of the points
+    void set_fixed_bounds(v3 min, v3 max) {
+        fixed_bounds = true;
+        minpos = min;
+        maxpos = max;
+        update_scale();
+        assert(is_size_valid());
+    }
+
+    void clear_fixed_bounds() {
+        fixed_bounds = false;
+    }
+
+    void update_scale() {
+        size = maxpos - minpos;
+        for (u32 axis = 0; axis < 3; ++axis)
+            scale[axis] = (f32)M::coord_max / size[axis];
+    }
+
+    // index the points, identifying each one by its position in points
+    void make_index(const vector<v3> &points) {
+        u32 count = (u32)points.size();
+        ids.resize(count);
+        for (u32 i = 0; i < count; ++i)
+            ids[i] = i;
+        build(points.data(), count);
+    }
+
+    // index the points, identifying each one by the corresponding entry in
+    // point_ids in lookup results
+    void make_index(const vector<v3> &points, const vector<u32> &point_ids) {
+        assert(points.size() == point_ids.size());
+        ids = point_ids;
+        build(points.data(), (u32)points.size());
+    }
+
+    // expects ids to be filled in already
+    void build(const v3 *points, u32 count) {
+        if (!fixed_bounds) {
+            compute_bounds(points, count, minpos, maxpos);
+            update_scale();
+        }
+        if (!is_size_valid()) {
+            zvalues.clear();
+            ids.clear();
+            return;
+        }
+        zvalues.resize(count);
+        for (u32 i = 0; i < count; ++i)
+            zvalues[i] = to_z(points[i]);
+        zorder::radix_sort(zvalues, ids, zvalue_scratch, id_scratch);
+    }
+
+    // find the ids of all points inside the box spanned by p0 and p1
+    void area_lookup(v3 p0, v3 p1, vector<u32> &result) {
+        result.clear();
+        if (zvalues.empty() || !is_size_valid())
+            return;
+
+        u32 lo[3], hi[3];
+        u32 block = 1;
+        for (u32 axis = 0; axis < 3; ++axis) {
+            lo[axis] = discretize(p0[axis], axis);
+            hi[axis] = discretize(p1[axis], axis);
+            if (hi[axis] < lo[axis])
+                swap(lo[axis], hi[axis]);
+            block = max(block, calc_block_size(hi[axis] - lo[axis]));
+        }
+
+        // snap to a power of two block size, like the 2d index does
+        u32 lo2[3], hi2[3];
+        for (u32 axis = 0; axis < 3; ++axis) {
+            lo2[axis] = snap_min(lo[axis], block);
+            hi2[axis] = snap_max(hi[axis], block);
+        }
+
+        u32 budget = max(range_budget, 1u);
+        if (budget > max_range_budget)
+            budget = max_range_budget;
+        range_count = partition_range(lo2, hi2, ranges, budget);
+
+        const Key *zbegin = zvalues.data();
+        const Key *zend = zbegin + zvalues.size();
+        const Key *it = zbegin;
+
+        for (u32 i = 0; i < range_count; ++i) {
+            pair<Key,Key> r = ranges[i];
+            if (it == zend)
+                break;
+            if (*it > r.second)
+                continue;
+            it = zorder::gallop_lower_bound(it, zend, r.first);
+            for (; it != zend && *it <= r.second; ++it) {
+                u32 c[3];
+                M::deinterleave(*it, c);
+                if (c[0] < lo[0] || c[0] > hi[0] ||
+                    c[1] < lo[1] || c[1] > hi[1] ||
+                    c[2] < lo[2] || c[2] > hi[2])
+                    continue;
+                result.push_back(ids[it - zbegin]);
+            }
+        }
+    }
+};
+
+// 10 bits per axis
+typedef BasicZOrderIndex3<u32> ZOrderIndex3;
+// 21 bits per axis
+typedef BasicZOrderIndex3<u64> ZOrderIndex3_64;
+
+
+} // namespace zorder3